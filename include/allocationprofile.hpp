@@ -0,0 +1,754 @@
+#ifndef __ALLOCATION_PROFILE_HPP
+#define __ALLOCATION_PROFILE_HPP
+
+#include "pin.H"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "histogram.hpp"
+#include "jsonwriter.hpp"
+#include "objectdata.hpp"
+
+using namespace std;
+
+// Each thread's table of sites starts out with room for initialSitesPerThread
+// and doubles whenever it is 3/4 full, up to the -max_sites limit
+//
+static const UINT32 initialSitesPerThread = 64; // Must be a power of two
+static const UINT32 defaultMaxSitesPerThread = 4096;
+
+// Objects of a serialized site count as reuse candidates as long as the largest
+// is at most reuseSizeSlack times the size of the smallest
+//
+static const UINT32 reuseSizeSlack = 2;
+
+// Frame-local objects that touch less than 1/lowCoverageRatio of their bytes
+// would have done with a much smaller stack buffer
+//
+static const UINT32 lowCoverageRatio = 4;
+
+// Distributions of the objects allocated by one call site
+//
+class SiteProfile
+{
+    public:
+        SiteProfile(UINT64 site, Backtrace &mallocTrace) :
+            numAllocations(0),
+            numOutstanding(0),
+            numSerialized(0),
+            minSize(~(UINT64) 0),
+            maxSize(0),
+            overlapped(FALSE),
+            numThreads(0),
+            mallocCycles(0),
+            freeCycles(0),
+            numTimedFrees(0),
+            numFrameLocal(0),
+            numLowCoverage(0),
+            maxFrameLocalSize(0),
+            maxFrameLocalTouched(0),
+            maxFrameLocalDepth(0),
+            site(site),
+            mallocTrace(mallocTrace)
+        { }
+
+        // Called on every tracked malloc from this site. An allocation is
+        // serialized if every earlier object from this site (and thread) was
+        // already freed, meaning a single buffer could have served all of them
+        //
+        VOID RecordMalloc(UINT64 size, UINT64 cycles)
+        {
+            if (numOutstanding > 0)
+            {
+                overlapped = TRUE;
+            }
+            else if (numAllocations > 0)
+            {
+                numSerialized++;
+            }
+            if (numAllocations == 0)
+            {
+                numThreads = 1;
+            }
+            numAllocations++;
+            numOutstanding++;
+            mallocCycles += cycles;
+            if (size < minSize)
+            {
+                minSize = size;
+            }
+            if (size > maxSize)
+            {
+                maxSize = size;
+            }
+        }
+
+        // Called when an object from this site is freed by the thread that
+        // allocated it. Objects freed by other threads stay outstanding, since
+        // a buffer shared across threads can't simply be hoisted
+        //
+        VOID RecordFree(Backtrace &trace)
+        {
+            if (numOutstanding > 0)
+            {
+                numOutstanding--;
+            }
+            if (freeTrace.GetCallSite() == 0)
+            {
+                freeTrace = trace;
+            }
+        }
+
+        VOID RecordFreeCycles(UINT64 cycles)
+        {
+            freeCycles += cycles;
+            numTimedFrees++;
+        }
+
+        // Called for objects that could have been allocated on the stack of a
+        // function depth frames up their malloc backtrace (see
+        // ObjectData::GetFrameLocalDepth()). A buffer in the outermost of these
+        // frames would serve all of the site's frame-local objects
+        //
+        VOID RecordFrameLocal(UINT64 size, UINT64 bytesTouched, INT32 depth)
+        {
+            numFrameLocal++;
+            if ((UINT32) depth > maxFrameLocalDepth)
+            {
+                maxFrameLocalDepth = depth;
+            }
+            if (bytesTouched * lowCoverageRatio < size)
+            {
+                numLowCoverage++;
+            }
+            if (size > maxFrameLocalSize)
+            {
+                maxFrameLocalSize = size;
+            }
+            if (bytesTouched > maxFrameLocalTouched)
+            {
+                maxFrameLocalTouched = bytesTouched;
+            }
+        }
+
+        UINT64 GetAverageMallocCycles() { return numAllocations > 0 ? mallocCycles / numAllocations : 0; }
+
+        UINT64 GetAverageFreeCycles() { return numTimedFrees > 0 ? freeCycles / numTimedFrees : 0; }
+
+        // Cycles spent in malloc and free on behalf of the objects that could
+        // have lived on the stack, which moving them there would save. How much
+        // of each object was touched doesn't change these cycles, only how
+        // large the stack buffer has to be (see numLowCoverage)
+        //
+        UINT64 GetProjectedSavings()
+        {
+            return numFrameLocal * (GetAverageMallocCycles() + GetAverageFreeCycles());
+        }
+
+        BOOL IsReuseCandidate()
+        {
+            return !overlapped && numSerialized > 0 && maxSize <= reuseSizeSlack * minSize;
+        }
+
+        VOID Record(UINT64 size, UINT64 lifetime, UINT64 bytesTouched)
+        {
+            sizes.Record(size);
+            lifetimes.Record(lifetime);
+            touched.Record(bytesTouched);
+        }
+
+        VOID Merge(const SiteProfile &p)
+        {
+            sizes.Merge(p.sizes);
+            lifetimes.Merge(p.lifetimes);
+            touched.Merge(p.touched);
+            numAllocations += p.numAllocations;
+            numSerialized += p.numSerialized;
+            overlapped = overlapped || p.overlapped;
+            minSize = p.minSize < minSize ? p.minSize : minSize;
+            maxSize = p.maxSize > maxSize ? p.maxSize : maxSize;
+            numThreads += p.numThreads;
+            mallocCycles += p.mallocCycles;
+            freeCycles += p.freeCycles;
+            numTimedFrees += p.numTimedFrees;
+            numFrameLocal += p.numFrameLocal;
+            numLowCoverage += p.numLowCoverage;
+            maxFrameLocalSize = p.maxFrameLocalSize > maxFrameLocalSize ? p.maxFrameLocalSize : maxFrameLocalSize;
+            maxFrameLocalTouched = p.maxFrameLocalTouched > maxFrameLocalTouched ? p.maxFrameLocalTouched : maxFrameLocalTouched;
+            maxFrameLocalDepth = p.maxFrameLocalDepth > maxFrameLocalDepth ? p.maxFrameLocalDepth : maxFrameLocalDepth;
+            if (freeTrace.GetCallSite() == 0)
+            {
+                freeTrace = p.freeTrace;
+            }
+        }
+
+        UINT64 GetSite() { return site; }
+
+        Backtrace &GetMallocTrace() { return mallocTrace; }
+
+        // Backtrace of the first free by the allocating thread
+        //
+        Backtrace &GetFreeTrace() { return freeTrace; }
+
+        // Approximate number of bytes this profile takes up. Until a free
+        // backtrace is set, room for one as long as the malloc one is set aside
+        //
+        UINT64 GetBytes()
+        {
+            UINT64 mallocBytes, freeBytes;
+
+            mallocBytes = mallocTrace.GetStringBytes();
+            freeBytes = freeTrace.GetStringBytes();
+            return sizeof(*this) + mallocBytes + (mallocBytes > freeBytes ? mallocBytes : freeBytes);
+        }
+
+        // What GetBytes() will return for a new profile of a site reached by b
+        //
+        static UINT64 EstimateBytes(Backtrace &b)
+        {
+            return sizeof(SiteProfile) + 2 * b.GetStringBytes();
+        }
+
+        Histogram sizes, lifetimes, touched;
+
+        // Buffer reuse state, tracked at malloc time
+        //
+        UINT64 numAllocations, numOutstanding, numSerialized;
+        UINT64 minSize, maxSize;
+        BOOL overlapped;
+        UINT32 numThreads;
+
+        // Stack allocation cost model. malloc/free cycles are measured under
+        // instrumentation, so they overstate native costs
+        //
+        UINT64 mallocCycles, freeCycles, numTimedFrees;
+        UINT64 numFrameLocal, numLowCoverage, maxFrameLocalSize, maxFrameLocalTouched;
+        UINT32 maxFrameLocalDepth;
+
+    private:
+        UINT64 site;
+        Backtrace mallocTrace, freeTrace;
+};
+
+JsonWriter& operator<<(JsonWriter& w, SiteProfile& p)
+{
+    w.BeginObject();
+    w.Key("site"); w << p.GetMallocTrace();
+    w.Key("size"); w << p.sizes;
+    w.Key("lifetimeCycles"); w << p.lifetimes;
+    w.Key("bytesTouched"); w << p.touched;
+
+    // Reuse state of every site, not just the candidates, so that merge.py can
+    // combine processes the same way Merge() combines threads
+    //
+    w.Key("reuse");
+    w.BeginObject();
+    w.Key("freeSite"); w << p.GetFreeTrace();
+    w.Key("allocations"); w.UInt(p.numAllocations);
+    w.Key("serialized"); w.UInt(p.numSerialized);
+    w.Key("overlapped"); w.Bool(p.overlapped);
+    w.Key("minSize"); w.UInt(p.minSize);
+    w.Key("maxSize"); w.UInt(p.maxSize);
+    w.Key("threads"); w.UInt(p.numThreads);
+    w.EndObject();
+
+    // Likewise for the stack allocation cost model. Cycles are written as
+    // sums so that they can be averaged over the merged counts
+    //
+    w.Key("stack");
+    w.BeginObject();
+    w.Key("frameLocal"); w.UInt(p.numFrameLocal);
+    w.Key("lowCoverage"); w.UInt(p.numLowCoverage);
+    w.Key("mallocCycles"); w.UInt(p.mallocCycles);
+    w.Key("freeCycles"); w.UInt(p.freeCycles);
+    w.Key("timedFrees"); w.UInt(p.numTimedFrees);
+    w.Key("maxSize"); w.UInt(p.maxFrameLocalSize);
+    w.Key("maxBytesTouched"); w.UInt(p.maxFrameLocalTouched);
+    w.Key("frameDepth"); w.UInt(p.maxFrameLocalDepth);
+    w.EndObject();
+    w.EndObject();
+
+    return w;
+}
+
+// Per-thread allocation profile: histograms of the size, lifetime and bytes
+// touched of every object freed by the thread, overall and per call site
+//
+// Nothing within AllocationProfile is thread-safe, each thread records into
+// its own profile without taking any locks
+//
+class AllocationProfile
+{
+    public:
+        AllocationProfile() :
+            sites(nullptr),
+            siteCapacity(0),
+            maxSites(defaultMaxSitesPerThread),
+            numSites(0),
+            siteBytes(0),
+            freedSite(nullptr),
+            numUnprofiledObjects(0),
+            numUnprofiledMallocs(0)
+        { }
+
+        ~AllocationProfile()
+        {
+            Reset();
+        }
+
+        // Must be called before the first site is added
+        //
+        VOID SetMaxSites(UINT32 maxSites) { this->maxSites = maxSites; }
+
+        VOID Reset()
+        {
+            for (UINT32 i = 0; i < siteCapacity; i++)
+            {
+                delete sites[i];
+            }
+            delete[] sites;
+            sites = nullptr;
+            siteCapacity = 0;
+            numSites = 0;
+            siteBytes = 0;
+            sizes = Histogram();
+            lifetimes = Histogram();
+            touched = Histogram();
+            freedSite = nullptr;
+            numUnprofiledObjects = 0;
+            numUnprofiledMallocs = 0;
+        }
+
+        // The object's site is only added to the profile if createSite is set,
+        // otherwise an object from a site this thread hasn't seen yet is left
+        // unprofiled
+        //
+        VOID Record(ObjectData &d, BOOL createSite)
+        {
+            SiteProfile *p;
+            UINT64 size, lifetime, bytesTouched, bytes;
+            INT32 depth;
+
+            size = d.GetSize();
+            lifetime = d.GetLifetime();
+            bytesTouched = d.CalculateBytesTouched();
+
+            sizes.Record(size);
+            lifetimes.Record(lifetime);
+            touched.Record(bytesTouched);
+
+            p = FindSite(d.GetMallocTrace(), createSite);
+            if (p == nullptr)
+            {
+                numUnprofiledObjects++;
+                return;
+            }
+            p->Record(size, lifetime, bytesTouched);
+            if (d.GetFreeThread() == d.GetMallocThread())
+            {
+                bytes = p->GetBytes();
+                p->RecordFree(d.GetFreeTrace());
+                siteBytes += p->GetBytes() - bytes;
+            }
+            depth = d.GetFrameLocalDepth();
+            if (depth >= 0)
+            {
+                p->RecordFrameLocal(size, bytesTouched, depth);
+            }
+            freedSite = p;
+        }
+
+        // Charge the cycles spent in the free() that just returned to the site
+        // of the object it freed, if that object was recorded
+        //
+        VOID RecordFreeCycles(UINT64 cycles)
+        {
+            if (freedSite != nullptr)
+            {
+                freedSite->RecordFreeCycles(cycles);
+                freedSite = nullptr;
+            }
+        }
+
+        // O(1) apart from the first malloc of a site, which allocates its slot
+        //
+        VOID RecordMalloc(Backtrace &b, UINT64 size, UINT64 cycles)
+        {
+            SiteProfile *p;
+
+            p = FindSite(b, TRUE);
+            if (p == nullptr)
+            {
+                numUnprofiledMallocs++;
+                return;
+            }
+            p->RecordMalloc(size, cycles);
+        }
+
+        // Look up the call site of b, adding it if this thread hasn't seen it yet
+        // and create is set. Returns nullptr if the site isn't there and wasn't
+        // added, which is always the case once maxSites sites are in use
+        //
+        SiteProfile *FindSite(Backtrace &b, BOOL create)
+        {
+            UINT64 site;
+            UINT32 i;
+
+            site = b.GetCallSite();
+            i = FindSlot(site);
+            if (i < siteCapacity && sites[i] != nullptr)
+            {
+                return sites[i];
+            }
+            if (!create || numSites >= maxSites)
+            {
+                return nullptr;
+            }
+            if (NeedsGrowth())
+            {
+                Grow();
+                i = FindSlot(site);
+            }
+            sites[i] = new SiteProfile(site, b);
+            numSites++;
+            siteBytes += sites[i]->GetBytes();
+            return sites[i];
+        }
+
+        // Bytes that adding the site of b would add to GetSiteBytes(), 0 if it
+        // is already there or wouldn't be added
+        //
+        UINT64 EstimateSiteBytes(Backtrace &b)
+        {
+            UINT64 bytes;
+
+            if (FindSite(b, FALSE) != nullptr || numSites >= maxSites)
+            {
+                return 0;
+            }
+            bytes = SiteProfile::EstimateBytes(b);
+            if (NeedsGrowth())
+            {
+                bytes += (GrowCapacity() - siteCapacity) * sizeof(SiteProfile*);
+            }
+            return bytes;
+        }
+
+        // Slots of the table, some of which are empty (nullptr)
+        //
+        UINT32 GetSiteCapacity() { return siteCapacity; }
+
+        SiteProfile *GetSite(UINT32 i) { return sites[i]; }
+
+        UINT32 GetNumSites() { return numSites; }
+
+        // Bytes taken up by the SiteProfiles of this thread (see
+        // SiteProfile::GetBytes())
+        //
+        UINT64 GetSiteBytes() { return siteBytes; }
+
+        UINT64 GetNumUnprofiledObjects() { return numUnprofiledObjects; }
+
+        UINT64 GetNumUnprofiledMallocs() { return numUnprofiledMallocs; }
+
+        Histogram sizes, lifetimes, touched;
+
+    private:
+        // Open addressing with linear probing. Returns the slot that holds site,
+        // or the empty slot it would go into, or siteCapacity if the table is
+        // full or was never allocated
+        //
+        UINT32 FindSlot(UINT64 site)
+        {
+            UINT32 i;
+
+            if (siteCapacity == 0)
+            {
+                return 0;
+            }
+            i = (UINT32) ((site * 0x9E3779B97F4A7C15ULL) >> 32) & (siteCapacity - 1);
+            for (UINT32 probes = 0; probes < siteCapacity; probes++)
+            {
+                if (sites[i] == nullptr || sites[i]->GetSite() == site)
+                {
+                    return i;
+                }
+                i = (i + 1) & (siteCapacity - 1);
+            }
+            return siteCapacity;
+        }
+
+        BOOL NeedsGrowth() { return (numSites + 1) * 4 > siteCapacity * 3; }
+
+        UINT32 GrowCapacity() { return siteCapacity == 0 ? initialSitesPerThread : 2 * siteCapacity; }
+
+        // Move every site into a table of twice the size. The table itself is
+        // counted in GetSiteBytes()
+        //
+        VOID Grow()
+        {
+            SiteProfile **oldSites;
+            UINT32 oldCapacity;
+
+            oldSites = sites;
+            oldCapacity = siteCapacity;
+            siteCapacity = GrowCapacity();
+            sites = new SiteProfile*[siteCapacity]();
+            for (UINT32 i = 0; i < oldCapacity; i++)
+            {
+                if (oldSites[i] != nullptr)
+                {
+                    sites[FindSlot(oldSites[i]->GetSite())] = oldSites[i];
+                }
+            }
+            delete[] oldSites;
+            siteBytes += (UINT64) (siteCapacity - oldCapacity) * sizeof(SiteProfile*);
+        }
+
+        SiteProfile **sites;
+        UINT32 siteCapacity, maxSites;
+        UINT32 numSites;
+        UINT64 siteBytes;
+        SiteProfile *freedSite; // Site of the object freed by the free() in progress
+        UINT64 numUnprofiledObjects, numUnprofiledMallocs;
+};
+
+static BOOL CompareSiteCounts(SiteProfile *a, SiteProfile *b)
+{
+    return a->sizes.GetCount() > b->sizes.GetCount();
+}
+
+static BOOL CompareSerialized(SiteProfile *a, SiteProfile *b)
+{
+    return a->numSerialized > b->numSerialized;
+}
+
+static BOOL CompareSavings(SiteProfile *a, SiteProfile *b)
+{
+    return a->GetProjectedSavings() > b->GetProjectedSavings();
+}
+
+// ProfileSummary merges the AllocationProfiles of all threads. Threads that
+// exit early are folded in right away so that their profiles can be freed,
+// the rest once the application has terminated
+//
+// NOT THREAD-SAFE
+//
+class ProfileSummary
+{
+    public:
+        ProfileSummary() : numExitedThreads(0), siteBytes(0), numUnprofiledObjects(0), numUnprofiledMallocs(0) { }
+
+        VOID Reset()
+        {
+            global.Reset();
+            exited.Reset();
+            numExitedThreads = 0;
+            threads.clear();
+            sites.clear();
+            siteBytes = 0;
+            numUnprofiledObjects = 0;
+            numUnprofiledMallocs = 0;
+        }
+
+        // Sites whose objects never overlapped in time within a thread, ranked by
+        // the number of malloc/free pairs that hoisting one buffer per thread
+        // would eliminate
+        //
+        VOID PrintReuseCandidates(JsonWriter &w)
+        {
+            vector<SiteProfile*> candidates;
+            unordered_map<UINT64,SiteProfile>::iterator it;
+
+            for (it = sites.begin(); it != sites.end(); it++)
+            {
+                if (it->second.IsReuseCandidate())
+                {
+                    candidates.push_back(&it->second);
+                }
+            }
+            sort(candidates.begin(), candidates.end(), CompareSerialized);
+
+            w.BeginArray();
+            for (UINT32 i = 0; i < candidates.size(); i++)
+            {
+                w.BeginObject();
+                w.Key("mallocSite"); w << candidates[i]->GetMallocTrace();
+                w.Key("freeSite"); w << candidates[i]->GetFreeTrace();
+                w.Key("allocations"); w.UInt(candidates[i]->numAllocations);
+                w.Key("eliminatedPairs"); w.UInt(candidates[i]->numSerialized);
+                w.Key("minSize"); w.UInt(candidates[i]->minSize);
+                w.Key("maxSize"); w.UInt(candidates[i]->maxSize);
+                w.Key("threads"); w.UInt(candidates[i]->numThreads);
+                w.EndObject();
+            }
+            w.EndArray();
+        }
+
+        // Sites with objects that never outlived the function that allocated
+        // them, ranked by the cycles that stack allocating those objects would
+        // save. Sites whose objects get larger than stackLimit bytes are still
+        // listed, but flagged as too large for a stack frame
+        //
+        VOID PrintStackCandidates(JsonWriter &w, UINT32 maxCandidates, UINT64 stackLimit)
+        {
+            vector<SiteProfile*> candidates;
+            unordered_map<UINT64,SiteProfile>::iterator it;
+            SiteProfile *c;
+
+            for (it = sites.begin(); it != sites.end(); it++)
+            {
+                if (it->second.numFrameLocal > 0)
+                {
+                    candidates.push_back(&it->second);
+                }
+            }
+            sort(candidates.begin(), candidates.end(), CompareSavings);
+            if (maxCandidates > 0 && candidates.size() > maxCandidates)
+            {
+                candidates.resize(maxCandidates);
+            }
+
+            w.BeginArray();
+            for (UINT32 i = 0; i < candidates.size(); i++)
+            {
+                c = candidates[i];
+                w.BeginObject();
+                w.Key("mallocSite"); w << c->GetMallocTrace();
+                w.Key("freeSite"); w << c->GetFreeTrace();
+                w.Key("allocations"); w.UInt(c->numAllocations);
+                w.Key("frameLocal"); w.UInt(c->numFrameLocal);
+                w.Key("frameDepth"); w.UInt(c->maxFrameLocalDepth);
+                w.Key("lowCoverage"); w.UInt(c->numLowCoverage);
+                w.Key("avgMallocCycles"); w.UInt(c->GetAverageMallocCycles());
+                w.Key("avgFreeCycles"); w.UInt(c->GetAverageFreeCycles());
+                w.Key("projectedCyclesSaved"); w.UInt(c->GetProjectedSavings());
+                w.Key("maxSize"); w.UInt(c->maxFrameLocalSize);
+                w.Key("maxBytesTouched"); w.UInt(c->maxFrameLocalTouched);
+                w.Key("fitsOnStack"); w.Bool(c->maxFrameLocalSize <= stackLimit);
+                w.EndObject();
+            }
+            w.EndArray();
+        }
+
+        // p must outlive the summary, since its histograms are written out
+        // per thread
+        //
+        VOID Add(THREADID threadId, AllocationProfile *p)
+        {
+            threads.push_back(make_pair(threadId, p));
+            Merge(p);
+        }
+
+        // Merge in the profile of a thread that exited, which may be freed
+        // afterwards. Its histograms are only written out summed up with those
+        // of the other threads that exited
+        //
+        VOID Fold(AllocationProfile *p)
+        {
+            exited.sizes.Merge(p->sizes);
+            exited.lifetimes.Merge(p->lifetimes);
+            exited.touched.Merge(p->touched);
+            numExitedThreads++;
+            Merge(p);
+        }
+
+        // Approximate number of bytes the merged sites take up
+        //
+        UINT64 GetSiteBytes() { return siteBytes; }
+
+        AllocationProfile global, exited;
+        UINT32 numExitedThreads;
+        vector<pair<THREADID,AllocationProfile*> > threads;
+        unordered_map<UINT64,SiteProfile> sites;
+        UINT64 siteBytes;
+        UINT64 numUnprofiledObjects, numUnprofiledMallocs;
+
+    private:
+        VOID Merge(AllocationProfile *p)
+        {
+            SiteProfile *s;
+            unordered_map<UINT64,SiteProfile>::iterator it;
+            UINT64 bytes;
+
+            global.sizes.Merge(p->sizes);
+            global.lifetimes.Merge(p->lifetimes);
+            global.touched.Merge(p->touched);
+            numUnprofiledObjects += p->GetNumUnprofiledObjects();
+            numUnprofiledMallocs += p->GetNumUnprofiledMallocs();
+
+            for (UINT32 i = 0; i < p->GetSiteCapacity(); i++)
+            {
+                s = p->GetSite(i);
+                if (s == nullptr)
+                {
+                    continue;
+                }
+                it = sites.find(s->GetSite());
+                if (it == sites.end())
+                {
+                    it = sites.insert(make_pair(s->GetSite(), *s)).first;
+                    siteBytes += it->second.GetBytes();
+                }
+                else {
+                    bytes = it->second.GetBytes();
+                    it->second.Merge(*s);
+                    siteBytes += it->second.GetBytes() - bytes;
+                }
+            }
+        }
+};
+
+JsonWriter& operator<<(JsonWriter& w, ProfileSummary& summary)
+{
+    vector<SiteProfile*> sites;
+    unordered_map<UINT64,SiteProfile>::iterator it;
+
+    w.BeginObject();
+    w.Key("size"); w << summary.global.sizes;
+    w.Key("lifetimeCycles"); w << summary.global.lifetimes;
+    w.Key("bytesTouched"); w << summary.global.touched;
+
+    w.Key("threads");
+    w.BeginArray();
+    for (UINT32 i = 0; i < summary.threads.size(); i++)
+    {
+        w.BeginObject();
+        w.Key("thread"); w.Int((INT32) summary.threads[i].first);
+        w.Key("size"); w << summary.threads[i].second->sizes;
+        w.Key("lifetimeCycles"); w << summary.threads[i].second->lifetimes;
+        w.Key("bytesTouched"); w << summary.threads[i].second->touched;
+        w.EndObject();
+    }
+    w.EndArray();
+    w.Key("exitedThreads");
+    w.BeginObject();
+    w.Key("threads"); w.UInt(summary.numExitedThreads);
+    w.Key("size"); w << summary.exited.sizes;
+    w.Key("lifetimeCycles"); w << summary.exited.lifetimes;
+    w.Key("bytesTouched"); w << summary.exited.touched;
+    w.EndObject();
+
+    // Busiest call sites first
+    //
+    for (it = summary.sites.begin(); it != summary.sites.end(); it++)
+    {
+        sites.push_back(&it->second);
+    }
+    sort(sites.begin(), sites.end(), CompareSiteCounts);
+    w.Key("sites");
+    w.BeginArray();
+    for (UINT32 i = 0; i < sites.size(); i++)
+    {
+        w << *sites[i];
+    }
+    w.EndArray();
+    w.Key("unprofiledSiteObjects"); w.UInt(summary.numUnprofiledObjects);
+    w.Key("unprofiledSiteMallocs"); w.UInt(summary.numUnprofiledMallocs);
+    w.EndObject();
+
+    return w;
+}
+
+#endif
@@ -2,11 +2,12 @@
 #define __BACKTRACE_HPP
 
 #include "pin.H"
-#include <iostream>
+#include <string>
+#include "jsonwriter.hpp"
 
 using namespace std;
 
-static const INT32 maxDepth = 3;
+static const INT32 maxDepth = 3; // Must be at least 2 and at most 10
 
 // Nothing within Backtrace is thread-safe since all of its
 // methods are only ever executed by one thread
@@ -17,12 +18,13 @@ class Backtrace
         // A Backtrace is initialized with the maximum number of stack frames
         // that it will go down
         //
-        Backtrace()
+        Backtrace() : stackPtr(0)
         {
             for (INT32 i = 0; i < maxDepth; i++)
             {
                 trace[i].first = "";
                 trace[i].second = 0;
+                frames[i] = 0;
             }
         }
 
@@ -44,12 +46,18 @@ class Backtrace
             //
             PIN_LockClient();
             depth = PIN_Backtrace(ctxt, buf, maxDepth + 1) - 1;
+            stackPtr = PIN_GetContextReg(ctxt, REG_STACK_PTR);
+            for (INT32 i = 0; i < maxDepth; i++)
+            {
+                frames[i] = 0;
+            }
 
             // We set i = 1 because we don't want to include the stack frame 
             // for malloc/free
             //
             for (INT32 i = 1; i < depth + 1; i++)
             {
+                frames[i - 1] = (ADDRINT) buf[i];
         
                 // NOTE: executable must be compiled with -g -gdwarf-2 -rdynamic
                 // to locate the invocation of malloc/free
@@ -65,57 +73,145 @@ class Backtrace
 
         pair<string,INT32> *GetTrace() { return trace; }
 
+        // Identifies the call site by all of the return addresses in the trace,
+        // not just the innermost one, so that allocations made through a
+        // wrapper (e.g. operator new) are told apart by the wrapper's callers.
+        // 0 if the trace was never set
+        //
+        UINT64 GetCallSite()
+        {
+            UINT64 hash;
+
+            if (frames[0] == 0)
+            {
+                return 0;
+            }
+            hash = 0xCBF29CE484222325ULL;
+            for (INT32 i = 0; i < maxDepth; i++)
+            {
+                hash = (hash ^ frames[i]) * 0x100000001B3ULL;
+            }
+            return hash;
+        }
+
+        // Depth of the innermost function in this trace (0 for the one that
+        // made this call, e.g. to malloc) that was still on the stack when the
+        // call described by later (e.g. to free) was made, or -1 if there is
+        // none. A function is live if later was made from within a call to it
+        // from the same place, i.e. the return addresses above it in this
+        // trace appear below the innermost frame of later, in the same order.
+        // This lets wrappers like operator new return before the object dies
+        //
+        // This is a heuristic: a function that returned and was called again
+        // from the same place is indistinguishable from one that never
+        // returned. Only the stack pointer at the call itself is known, so
+        // for the caller (depth 0) later must also have been made at or below
+        // it. The frames of outer functions can't be bounded that way
+        //
+        INT32 GetLiveFrameDepth(Backtrace &later)
+        {
+            for (INT32 depth = 0; depth < maxDepth - 1 && frames[depth + 1] != 0; depth++)
+            {
+                if (depth == 0 && later.stackPtr > stackPtr)
+                {
+                    continue;
+                }
+                for (INT32 i = 1; i < maxDepth; i++)
+                {
+                    if (MatchesFrom(depth + 1, later, i))
+                    {
+                        return depth;
+                    }
+                }
+            }
+            return -1;
+        }
+
+        // Heap memory held by the file names in trace. Short strings are kept
+        // within the string object itself and cost nothing extra
+        //
+        UINT64 GetStringBytes()
+        {
+            UINT64 bytes;
+            const char *data;
+
+            bytes = 0;
+            for (INT32 i = 0; i < maxDepth; i++)
+            {
+                data = trace[i].first.data();
+                if (data < reinterpret_cast<const char *>(&trace[i].first) ||
+                    data >= reinterpret_cast<const char *>(&trace[i].first + 1))
+                {
+                    bytes += trace[i].first.capacity() + 1;
+                }
+            }
+            return bytes;
+        }
+
         Backtrace &operator=(const Backtrace &b)
         {
             for (INT32 i = 0; i < maxDepth; i++)
             {
                 trace[i].first = b.trace[i].first;
                 trace[i].second = b.trace[i].second;
+                frames[i] = b.frames[i];
             }
+            stackPtr = b.stackPtr;
             return *this;
         }
 
     private:
+        // Whether the return addresses from frames[start] outward match those
+        // of other from other.frames[otherStart] outward, as far as both go
+        //
+        BOOL MatchesFrom(INT32 start, Backtrace &other, INT32 otherStart)
+        {
+            if (frames[start] != other.frames[otherStart])
+            {
+                return FALSE;
+            }
+            for (INT32 i = 1; start + i < maxDepth && otherStart + i < maxDepth; i++)
+            {
+                if (frames[start + i] != other.frames[otherStart + i])
+                {
+                    return FALSE;
+                }
+            }
+            return TRUE;
+        }
+
         // trace consists of all invocation points of malloc/free, 
         // represented as a pairing of a file name and a line number
         //
         pair<string,INT32> trace[maxDepth];
+        ADDRINT frames[maxDepth]; // Return addresses behind trace
+        ADDRINT stackPtr; // At the call to malloc/free
 };
 
-ostream& operator<<(ostream& os, Backtrace& bt)
+JsonWriter& operator<<(JsonWriter& w, Backtrace& bt)
 {
     pair<string,INT32> *t;
-    INT32 i;
+    char key[2];
 
     t = bt.GetTrace();
 
-    os << "{" << endl;
-
-    for (i = 0; i < maxDepth - 1; i++)
+    // Frames are keyed by their depth, which is always a single digit
+    //
+    w.BeginObject();
+    for (INT32 i = 0; i < maxDepth; i++)
     {
-        // If PIN_GetSourceLocation failed to map the IP to a 
-        // file + line number
-        //
-        if (t[i].first == "")
-        {
-            os << "\t\t\t\t\"" << i << "\" : \"\"," << endl;
-        }
-        else {
-            os << "\t\t\t\t\"" << i << "\" : \"" << t[i].first << ":" 
-                << t[i].second << "\"," << endl;
-        }
-    }
+        key[0] = '0' + i;
+        key[1] = '\0';
+        w.Key(key);
 
-    if (t[i].first == "")
-    {
-        os << "\t\t\t\t\"" << i << "\" : \"\"" << endl << "\t\t\t}";
-    }
-    else {
-        os << "\t\t\t\t\"" << i << "\" : \"" << t[i].first << ":" 
-            << t[i].second << "\"" << endl << "\t\t\t}";
+        // Location is written as "" if PIN_GetSourceLocation failed to map 
+        // the IP to a file + line number
+        //
+        w.Location(t[i].first, t[i].second);
     }
+    w.EndObject();
 
-    return os;
+    return w;
 }
 
 #endif
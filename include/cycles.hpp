@@ -0,0 +1,17 @@
+#ifndef __CYCLES_HPP
+#define __CYCLES_HPP
+
+#include "pin.H"
+
+// Read the time-stamp counter. HeapShark measures lifetimes and costs in
+// cycles since that's cheap enough to do on every malloc/free
+//
+static inline UINT64 ReadCycles()
+{
+    UINT32 lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((UINT64) hi << 32) | lo;
+}
+
+#endif
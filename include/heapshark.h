@@ -0,0 +1,24 @@
+#ifndef __HEAPSHARK_H
+#define __HEAPSHARK_H
+
+// Include this header in the application being profiled to mark the region
+// of interest. Run HeapShark with -roi to only profile memory accesses between
+// HEAPSHARK_START() and HEAPSHARK_STOP(). Without Pin, both are no-ops
+//
+// NOTE: the application must be compiled with -rdynamic (or otherwise keep
+// these symbols) so that HeapShark can find them
+//
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+__attribute__((weak, noinline)) void HEAPSHARK_START(void) { __asm__ volatile(""); }
+
+__attribute__((weak, noinline)) void HEAPSHARK_STOP(void) { __asm__ volatile(""); }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
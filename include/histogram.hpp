@@ -0,0 +1,142 @@
+#ifndef __HISTOGRAM_HPP
+#define __HISTOGRAM_HPP
+
+#include "pin.H"
+#include <cstring>
+#include "jsonwriter.hpp"
+
+using namespace std;
+
+// Histogram buckets are log-linear (as in HDR histograms): every power of two
+// is split into histSubBuckets linear sub-buckets, so values are recorded with
+// a relative error of at most 1 / histSubBuckets. Values below histSubBuckets * 2
+// are recorded exactly and values of 2^histMaxExponent or more share the last bucket
+//
+static const UINT32 histSubBucketBits = 3;
+static const UINT32 histSubBuckets = 1 << histSubBucketBits;
+static const UINT32 histMaxExponent = 48;
+static const UINT32 histNumBuckets = (histMaxExponent - histSubBucketBits + 1) * histSubBuckets;
+
+// Nothing within Histogram is thread-safe, each thread records into its own
+// histograms and they are only merged once the application has terminated
+//
+class Histogram
+{
+    public:
+        Histogram() : count(0), sum(0), min(~(UINT64) 0), max(0)
+        {
+            memset(buckets, 0, sizeof(buckets));
+        }
+
+        VOID Record(UINT64 value)
+        {
+            buckets[BucketIndex(value)]++;
+            count++;
+            sum += value;
+            if (value < min)
+            {
+                min = value;
+            }
+            if (value > max)
+            {
+                max = value;
+            }
+        }
+
+        VOID Merge(const Histogram &h)
+        {
+            for (UINT32 i = 0; i < histNumBuckets; i++)
+            {
+                buckets[i] += h.buckets[i];
+            }
+            count += h.count;
+            sum += h.sum;
+            if (h.min < min)
+            {
+                min = h.min;
+            }
+            if (h.max > max)
+            {
+                max = h.max;
+            }
+        }
+
+        UINT64 GetCount() { return count; }
+
+        UINT64 GetSum() { return sum; }
+
+        UINT64 GetMin() { return count == 0 ? 0 : min; }
+
+        UINT64 GetMax() { return max; }
+
+        UINT64 GetBucketCount(UINT32 i) { return buckets[i]; }
+
+        // Smallest value that is recorded in bucket i
+        //
+        static UINT64 BucketLowerBound(UINT32 i)
+        {
+            UINT32 group;
+
+            if (i < histSubBuckets)
+            {
+                return i;
+            }
+            group = i / histSubBuckets;
+            return (UINT64) (histSubBuckets + i % histSubBuckets) << (group - 1);
+        }
+
+    private:
+        static UINT32 BucketIndex(UINT64 value)
+        {
+            UINT32 exponent;
+
+            if (value < histSubBuckets)
+            {
+                return value;
+            }
+            exponent = 63 - __builtin_clzll(value);
+            if (exponent >= histMaxExponent)
+            {
+                return histNumBuckets - 1;
+            }
+
+            // The leading one selects the group and the next histSubBucketBits
+            // bits select the sub-bucket within it
+            //
+            return (exponent - histSubBucketBits + 1) * histSubBuckets + 
+                    ((value >> (exponent - histSubBucketBits)) & (histSubBuckets - 1));
+        }
+
+        UINT64 buckets[histNumBuckets];
+        UINT64 count, sum, min, max;
+};
+
+// Only non-empty buckets are written, each as [lowerBound, count]
+//
+JsonWriter& operator<<(JsonWriter& w, Histogram& h)
+{
+    w.BeginObject();
+    w.Key("count"); w.UInt(h.GetCount());
+    w.Key("sum"); w.UInt(h.GetSum());
+    w.Key("min"); w.UInt(h.GetMin());
+    w.Key("max"); w.UInt(h.GetMax());
+    w.Key("buckets");
+    w.BeginArray();
+    for (UINT32 i = 0; i < histNumBuckets; i++)
+    {
+        if (h.GetBucketCount(i) == 0)
+        {
+            continue;
+        }
+        w.BeginArray();
+        w.UInt(Histogram::BucketLowerBound(i));
+        w.UInt(h.GetBucketCount(i));
+        w.EndArray();
+    }
+    w.EndArray();
+    w.EndObject();
+
+    return w;
+}
+
+#endif
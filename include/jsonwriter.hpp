@@ -0,0 +1,329 @@
+#ifndef __JSON_WRITER_HPP
+#define __JSON_WRITER_HPP
+
+#include "pin.H"
+#include <cstring>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+static const size_t jsonBufferSize = 1 << 20;
+static const size_t jsonMaxScalar = 32; // Longest formatted number
+static const INT32 jsonMaxDepth = 16;
+static const INT32 jsonLineDepth = 2; // Members/elements at this depth or above get their own line
+
+// JsonWriter produces HeapShark's output. Output is formatted into one large
+// buffer that is only written out to the file when it fills up or the writer
+// is flushed, and commas between members/elements are inserted by the writer
+// itself, so the output is valid JSON no matter when records were flushed
+//
+// Records in the top-level arrays are written one per line, so the output can
+// also be consumed line by line
+//
+// Nothing within JsonWriter is thread-safe
+//
+class JsonWriter
+{
+    public:
+        JsonWriter() : buf(new char[jsonBufferSize]), length(0), depth(0), afterKey(FALSE) { }
+
+        ~JsonWriter()
+        {
+            Close();
+            delete[] buf;
+        }
+
+        BOOL Open(const string &fileName)
+        {
+            // buf is the only buffer, so that nothing is written out behind our back
+            //
+            file.rdbuf()->pubsetbuf(nullptr, 0);
+            file.open(fileName.c_str(), ios::out | ios::trunc | ios::binary);
+            length = 0;
+            depth = 0;
+            afterKey = FALSE;
+            return file.is_open();
+        }
+
+        VOID Close()
+        {
+            if (file.is_open())
+            {
+                Flush();
+                file.close();
+            }
+        }
+
+        // Close the file without writing out what is still buffered. Used in a
+        // forked child, whose buffer holds output that belongs to the parent
+        //
+        VOID Discard()
+        {
+            length = 0;
+            if (file.is_open())
+            {
+                file.close();
+            }
+        }
+
+        VOID Flush()
+        {
+            if (length > 0)
+            {
+                file.write(buf, length);
+                length = 0;
+            }
+            file.flush();
+        }
+
+        VOID BeginObject() { BeginValue(); Put('{'); Push(); }
+
+        VOID EndObject() { Pop(); Put('}'); }
+
+        VOID BeginArray() { BeginValue(); Put('['); Push(); }
+
+        VOID EndArray() { Pop(); Put(']'); }
+
+        VOID Key(const char *key)
+        {
+            BeginValue();
+            Put('"');
+            Append(key, strlen(key));
+            Append("\":", 2);
+            afterKey = TRUE;
+        }
+
+        VOID UInt(UINT64 value) { BeginValue(); FormatUInt(value); }
+
+        VOID Int(INT64 value)
+        {
+            BeginValue();
+            if (value < 0)
+            {
+                Put('-');
+                FormatUInt(-(UINT64) value);
+            }
+            else {
+                FormatUInt(value);
+            }
+        }
+
+        // Doubles are written in fixed notation with up to 6 decimal places
+        //
+        VOID Double(double value)
+        {
+            UINT64 integral, fraction;
+            char digits[6];
+            INT32 numDigits;
+
+            if (value != value || value > 1e18 || value < -1e18) // NaN or too large for fixed notation
+            {
+                Null();
+                return;
+            }
+
+            BeginValue();
+            if (value < 0)
+            {
+                Put('-');
+                value = -value;
+            }
+            integral = (UINT64) value;
+            fraction = (UINT64) ((value - integral) * 1e6 + 0.5);
+            if (fraction >= 1000000)
+            {
+                integral++;
+                fraction -= 1000000;
+            }
+            FormatUInt(integral);
+            if (fraction == 0)
+            {
+                return;
+            }
+
+            // Emit the fraction zero-padded to 6 digits, minus trailing zeros
+            //
+            for (INT32 i = 5; i >= 0; i--)
+            {
+                digits[i] = '0' + fraction % 10;
+                fraction /= 10;
+            }
+            numDigits = 6;
+            while (digits[numDigits - 1] == '0')
+            {
+                numDigits--;
+            }
+            Put('.');
+            Append(digits, numDigits);
+        }
+
+        VOID Bool(BOOL value)
+        {
+            BeginValue();
+            if (value)
+            {
+                Append("true", 4);
+            }
+            else {
+                Append("false", 5);
+            }
+        }
+
+        VOID Null() { BeginValue(); Append("null", 4); }
+
+        VOID String(const string &value)
+        {
+            BeginValue();
+            Put('"');
+            Escape(value);
+            Put('"');
+        }
+
+        // A source location, written as "file:line", or "" if file is empty
+        //
+        VOID Location(const string &file, INT32 line)
+        {
+            BeginValue();
+            Put('"');
+            if (!file.empty())
+            {
+                Escape(file);
+                Put(':');
+                FormatUInt(line);
+            }
+            Put('"');
+        }
+
+    private:
+        // Insert whatever has to precede a new member/element: nothing after a
+        // key, otherwise a comma if it isn't the first one in its container
+        //
+        VOID BeginValue()
+        {
+            if (afterKey)
+            {
+                afterKey = FALSE;
+                return;
+            }
+            if (depth == 0)
+            {
+                return;
+            }
+            if (notFirst[depth - 1])
+            {
+                Put(',');
+            }
+            notFirst[depth - 1] = TRUE;
+            if (depth <= jsonLineDepth)
+            {
+                Put('\n');
+            }
+        }
+
+        VOID Push()
+        {
+            ASSERTX(depth < jsonMaxDepth);
+            notFirst[depth++] = FALSE;
+        }
+
+        VOID Pop()
+        {
+            BOOL empty;
+
+            empty = !notFirst[--depth];
+            if (!empty && depth < jsonLineDepth)
+            {
+                Put('\n');
+            }
+        }
+
+        VOID FormatUInt(UINT64 value)
+        {
+            char digits[jsonMaxScalar];
+            INT32 i;
+
+            // Digits are produced back to front
+            //
+            i = jsonMaxScalar;
+            do
+            {
+                digits[--i] = '0' + value % 10;
+                value /= 10;
+            } while (value != 0);
+            Append(digits + i, jsonMaxScalar - i);
+        }
+
+        VOID Escape(const string &value)
+        {
+            static const char hex[] = "0123456789abcdef";
+            size_t start;
+            unsigned char c;
+
+            // Copy runs of characters that need no escaping in one go
+            //
+            start = 0;
+            for (size_t i = 0; i < value.size(); i++)
+            {
+                c = value[i];
+                if (c != '"' && c != '\\' && c >= 0x20)
+                {
+                    continue;
+                }
+                Append(value.data() + start, i - start);
+                start = i + 1;
+                if (c == '"' || c == '\\')
+                {
+                    Put('\\');
+                    Put(c);
+                }
+                else {
+                    Append("\\u00", 4);
+                    Put(hex[c >> 4]);
+                    Put(hex[c & 0xf]);
+                }
+            }
+            Append(value.data() + start, value.size() - start);
+        }
+
+        VOID Put(char c)
+        {
+            if (length == jsonBufferSize)
+            {
+                Drain();
+            }
+            buf[length++] = c;
+        }
+
+        VOID Append(const char *s, size_t n)
+        {
+            if (length + n > jsonBufferSize)
+            {
+                Drain();
+                if (n > jsonBufferSize)
+                {
+                    file.write(s, n);
+                    return;
+                }
+            }
+            memcpy(buf + length, s, n);
+            length += n;
+        }
+
+        // Hand the buffer to the file without forcing it out to the OS
+        //
+        VOID Drain()
+        {
+            file.write(buf, length);
+            length = 0;
+        }
+
+        ofstream file;
+        char *buf;
+        size_t length;
+        INT32 depth;
+        BOOL afterKey;
+        BOOL notFirst[jsonMaxDepth];
+};
+
+#endif
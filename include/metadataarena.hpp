@@ -0,0 +1,302 @@
+#ifndef __METADATA_ARENA_HPP
+#define __METADATA_ARENA_HPP
+
+#include "pin.H"
+#include <cstddef>
+#include <iostream>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+
+using namespace std;
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static const size_t arenaSlabSize = 2 * 1024 * 1024; // One x86 large page
+static const size_t arenaSmallSlabSize = 64 * 1024; // For budgets too small to spend on 2MB slabs
+static const size_t arenaPageSize = 4096;
+static const size_t arenaClassSize = 16;
+static const size_t arenaNumClasses = 16;
+static const size_t arenaMaxBlock = arenaClassSize * arenaNumClasses;
+
+// MetadataArena hands out the small, fixed-size blocks that back HeapShark's
+// own lookup structures (e.g. the nodes of liveObjects). Blocks are carved
+// out of 2MB slabs that are mapped with large pages whenever the OS lets us,
+// which keeps the TLB footprint of liveObjects lookups small
+//
+// Nothing within MetadataArena is thread-safe, callers must serialize
+// access to it (ObjectManager does so with liveObjectsLock)
+//
+class MetadataArena
+{
+    public:
+        MetadataArena() :
+            slabSize(arenaSlabSize),
+            slabCursor(nullptr),
+            slabEnd(nullptr),
+            mappedBytes(0),
+            hugePages(FALSE)
+        {
+            for (size_t i = 0; i < arenaNumClasses; i++)
+            {
+                freeLists[i] = nullptr;
+                numFree[i] = 0;
+            }
+        }
+
+        // Must be called before the first allocation. Slabs smaller than
+        // arenaSlabSize aren't backed by large pages
+        //
+        VOID SetSlabSize(size_t slabSize) { this->slabSize = slabSize; }
+
+        size_t GetSlabSize() { return slabSize; }
+
+        VOID *Allocate(size_t bytes)
+        {
+            size_t sizeClass;
+            VOID *block;
+
+            if (bytes > arenaMaxBlock)
+            {
+                return AllocateLarge(bytes);
+            }
+
+            // Round up to the nearest size class and reuse a freed block if
+            // one is available
+            //
+            sizeClass = SizeClass(bytes);
+            if (freeLists[sizeClass - 1] != nullptr)
+            {
+                block = freeLists[sizeClass - 1];
+                freeLists[sizeClass - 1] = *static_cast<VOID **>(block);
+                numFree[sizeClass - 1]--;
+                return block;
+            }
+
+            if (slabCursor + sizeClass * arenaClassSize > slabEnd)
+            {
+                slabCursor = static_cast<char *>(MapBlock(slabSize));
+                slabEnd = slabCursor + slabSize;
+            }
+            block = slabCursor;
+            slabCursor += sizeClass * arenaClassSize;
+            return block;
+        }
+
+        VOID Deallocate(VOID *block, size_t bytes)
+        {
+            size_t sizeClass;
+
+            if (bytes > arenaMaxBlock)
+            {
+                DeallocateLarge(block, bytes);
+                return;
+            }
+
+            // Small blocks are never returned to the OS, they are pushed onto
+            // the free list of their size class instead
+            //
+            sizeClass = SizeClass(bytes);
+            *static_cast<VOID **>(block) = freeLists[sizeClass - 1];
+            freeLists[sizeClass - 1] = block;
+            numFree[sizeClass - 1]++;
+        }
+
+        // Bytes a request of the given size actually occupies
+        //
+        size_t GetBlockSize(size_t bytes)
+        {
+            return bytes > arenaMaxBlock ? RoundLarge(bytes) : SizeClass(bytes) * arenaClassSize;
+        }
+
+        // Bytes that blocks of the given (small) size can be handed out from
+        // without mapping anything new
+        //
+        UINT64 GetAvailableBytes(size_t bytes)
+        {
+            size_t blockSize;
+
+            blockSize = GetBlockSize(bytes);
+            return numFree[SizeClass(bytes) - 1] * blockSize + (slabEnd - slabCursor) / blockSize * blockSize;
+        }
+
+        // Bytes currently mapped from the OS, including free blocks
+        //
+        UINT64 GetMappedBytes() { return mappedBytes; }
+
+        // Whether at least one mapping was backed by explicit large pages
+        // (MAP_HUGETLB) rather than relying on transparent huge pages
+        //
+        BOOL UsesHugePages() { return hugePages; }
+
+    private:
+        static size_t SizeClass(size_t bytes)
+        {
+            return bytes == 0 ? 1 : (bytes + arenaClassSize - 1) / arenaClassSize;
+        }
+
+        // Large blocks (e.g. the bucket arrays of liveObjects) get their own
+        // mapping
+        //
+        VOID *AllocateLarge(size_t bytes)
+        {
+            return MapBlock(RoundLarge(bytes));
+        }
+
+        VOID DeallocateLarge(VOID *block, size_t bytes)
+        {
+            size_t length;
+
+            length = RoundLarge(bytes);
+            mappedBytes -= length;
+            munmap(block, length);
+        }
+
+        size_t RoundLarge(size_t bytes)
+        {
+            size_t granule;
+
+            granule = bytes >= arenaSlabSize ? arenaSlabSize : arenaPageSize;
+            return (bytes + granule - 1) & ~(granule - 1);
+        }
+
+        // Only mappings of at least one large page are worth backing with
+        // large pages
+        //
+        VOID *MapBlock(size_t length)
+        {
+            VOID *p;
+
+            if (length >= arenaSlabSize)
+            {
+                return MapSlab(length);
+            }
+            p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+            {
+                MapFailed(length);
+            }
+            mappedBytes += length;
+            return p;
+        }
+
+        // Pin tools are built without exceptions, and none of HeapShark's
+        // lookup structures can do without their metadata
+        //
+        VOID MapFailed(size_t length)
+        {
+            cerr << "could not map " << length << " bytes of metadata" << endl;
+            PIN_ExitProcess(1);
+        }
+
+        // Map length bytes (a multiple of arenaSlabSize), preferring explicit
+        // large pages and falling back to a 2MB-aligned mapping that is
+        // eligible for transparent huge pages
+        //
+        VOID *MapSlab(size_t length)
+        {
+            char *p, *aligned;
+
+            #ifdef MAP_HUGETLB
+            p = static_cast<char *>(mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+            if (p != MAP_FAILED)
+            {
+                hugePages = TRUE;
+                mappedBytes += length;
+                return p;
+            }
+            #endif // MAP_HUGETLB
+
+            // Over-allocate by one slab so that we can trim the mapping down
+            // to a 2MB-aligned region
+            //
+            p = static_cast<char *>(mmap(nullptr, length + arenaSlabSize, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (p == MAP_FAILED)
+            {
+                MapFailed(length);
+            }
+            aligned = reinterpret_cast<char *>((reinterpret_cast<ADDRINT>(p) + arenaSlabSize - 1)
+                                                & ~(ADDRINT) (arenaSlabSize - 1));
+            if (aligned != p)
+            {
+                munmap(p, aligned - p);
+            }
+            munmap(aligned + length, (p + arenaSlabSize) - aligned);
+
+            #ifdef MADV_HUGEPAGE
+            madvise(aligned, length, MADV_HUGEPAGE);
+            #endif // MADV_HUGEPAGE
+
+            mappedBytes += length;
+            return aligned;
+        }
+
+        VOID *freeLists[arenaNumClasses];
+        UINT64 numFree[arenaNumClasses];
+        size_t slabSize;
+        char *slabCursor, *slabEnd;
+        UINT64 mappedBytes;
+        BOOL hugePages;
+};
+
+// ArenaAllocator adapts MetadataArena to the STL allocator interface so
+// that containers such as unordered_map can place their nodes in it
+//
+template <class T>
+class ArenaAllocator
+{
+    public:
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef size_t size_type;
+        typedef ptrdiff_t difference_type;
+
+        template <class U>
+        struct rebind { typedef ArenaAllocator<U> other; };
+
+        ArenaAllocator(MetadataArena *arena) : arena(arena) { }
+
+        template <class U>
+        ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.GetArena()) { }
+
+        pointer allocate(size_type n, const VOID * = nullptr)
+        {
+            return static_cast<pointer>(arena->Allocate(n * sizeof(T)));
+        }
+
+        VOID deallocate(pointer p, size_type n) { arena->Deallocate(p, n * sizeof(T)); }
+
+        size_type max_size() const { return ((size_type) -1) / sizeof(T); }
+
+        pointer address(reference x) const { return &x; }
+
+        const_pointer address(const_reference x) const { return &x; }
+
+        VOID construct(pointer p, const T &val) { new (static_cast<VOID *>(p)) T(val); }
+
+        template <class U, class... Args>
+        VOID construct(U *p, Args&&... args) { new (static_cast<VOID *>(p)) U(std::forward<Args>(args)...); }
+
+        template <class U>
+        VOID destroy(U *p) { p->~U(); }
+
+        MetadataArena *GetArena() const { return arena; }
+
+    private:
+        MetadataArena *arena;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.GetArena() == b.GetArena(); }
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.GetArena() != b.GetArena(); }
+
+#endif
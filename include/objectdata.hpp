@@ -2,33 +2,55 @@
 #define __OBJECT_DATA_HPP
 
 #include "pin.H"
-#include <iostream>
 #include <new>
 #include <vector>
 #include <stdatomic.h>
 #include "backtrace.hpp"
+#include "cycles.hpp"
+#include "jsonwriter.hpp"
 
 using namespace std;
 
+// Bitmask covering the bytes of an access of accessSize bytes (at most 64),
+// computed at compile time
+//
+template <UINT32 accessSize>
+struct AccessMask
+{
+    static const UINT64 value = accessSize >= 64 ? ~(UINT64) 0 : ((UINT64) 1 << (accessSize % 64)) - 1;
+};
+
+// Coverage updates are not synchronized by ObjectData itself, ObjectManager
+// only performs them while holding liveObjectsLock
+//
 class ObjectData
 {
     public:
-        ObjectData(ADDRINT addr, UINT32 size, THREADID mallocThread) : 
+        // Coverage is tracked at a granularity of (1 << granularityShift) bytes,
+        // so each bitmap entry stands for one granule of the object
+        //
+        ObjectData(ADDRINT addr, UINT32 size, THREADID mallocThread, UINT32 granularityShift) : 
             addr(addr),
             size(size),
+            granularityShift(granularityShift),
             mallocThread(mallocThread),
             freeThread(-1),
-            readBitmap(size, 0),
-            writeBitmap(size, 0)
+            mallocTime(ReadCycles()),
+            freeTime(0),
+            coverageDropped(FALSE),
+            numGranules(NumGranules(size, granularityShift)),
+            readBitmap(NumWords(numGranules), 0),
+            writeBitmap(NumWords(numGranules), 0)
         { 
             atomic_init(&numReads, 0);
             atomic_init(&numWrites, 0);
             atomic_init(&bytesRead, 0);
             atomic_init(&bytesWritten, 0);
-            PIN_InitLock(&readBitmapLock);
-            PIN_InitLock(&writeBitmapLock);
         }
 
+        // Meaningless if coverage was dropped to stay within the memory budget,
+        // see IsCoverageDropped()
+        //
         pair<double,double> CalculateCoverage() // NOT THREAD-SAFE
         {
             double readCoverage, writeCoverage;
@@ -39,36 +61,128 @@ class ObjectData
             // Calculate read and write coverage
             // NOTE: coverage can be misleading on structs/classes that require extra space for alignment
             //
-            for (UINT32 i = 0; i < size; i++)
+            for (UINT32 i = 0; i < readBitmap.size(); i++)
             {
-                if (readBitmap[i])
-                {
-                    bitsRead++;
-                }
-                if (writeBitmap[i])
-                {
-                    bitsWritten++;
-                }
+                bitsRead += __builtin_popcountll(readBitmap[i]);
+                bitsWritten += __builtin_popcountll(writeBitmap[i]);
+            }
+            readCoverage = numGranules == 0 ? 0 : (double) bitsRead / numGranules;
+            writeCoverage = numGranules == 0 ? 0 : (double) bitsWritten / numGranules;
+            return make_pair(readCoverage, writeCoverage);
+        }
+
+        // Release both bitmaps, after which coverage is no longer tracked for
+        // this object. Used by ObjectManager to stay within its memory budget
+        //
+        VOID DropCoverage()
+        {
+            vector<UINT64>().swap(readBitmap);
+            vector<UINT64>().swap(writeBitmap);
+            coverageDropped = TRUE;
+        }
+
+        BOOL IsCoverageDropped() { return coverageDropped; } // NOT THREAD-SAFE
+
+        // Number of distinct bytes that were read or written, at the precision
+        // of this object's coverage granularity
+        //
+        UINT32 CalculateBytesTouched() // NOT THREAD-SAFE
+        {
+            UINT64 granulesTouched, bytesTouched;
+
+            // Without coverage the best we can do is bound it by the bytes accessed
+            //
+            if (coverageDropped)
+            {
+                bytesTouched = (UINT64) GetBytesRead() + GetBytesWritten();
+                return bytesTouched < size ? bytesTouched : size;
+            }
+
+            granulesTouched = 0;
+            for (UINT32 i = 0; i < readBitmap.size(); i++)
+            {
+                granulesTouched += __builtin_popcountll(readBitmap[i] | writeBitmap[i]);
             }
-            readCoverage = (double) bitsRead / size;
-            writeCoverage = (double) bitsWritten / size;
-            return make_pair<double,double>(readCoverage, writeCoverage);
+            bytesTouched = granulesTouched << granularityShift;
+            return bytesTouched < size ? bytesTouched : size;
+        }
+
+        // Approximate number of bytes HeapShark spends on tracking this object
+        //
+        UINT64 GetMetadataBytes() // NOT THREAD-SAFE
+        {
+            return sizeof(*this) + GetCoverageBytes() + GetTraceBytes();
+        }
+
+        // Heap memory held by the backtraces. Until the object is freed, room
+        // for a free backtrace as long as the malloc one is set aside
+        //
+        UINT64 GetTraceBytes() // NOT THREAD-SAFE
+        {
+            UINT64 mallocBytes, freeBytes;
+
+            mallocBytes = mallocTrace.GetStringBytes();
+            freeBytes = freeTrace.GetStringBytes();
+            return mallocBytes > freeBytes ? mallocBytes : freeBytes;
+        }
+
+        // Bytes that DropCoverage() would give back
+        //
+        UINT64 GetCoverageBytes() // NOT THREAD-SAFE
+        {
+            return (readBitmap.capacity() + writeBitmap.capacity()) * sizeof(UINT64);
+        }
+
+        static UINT64 EstimateMetadataBytes(UINT32 size, UINT32 granularityShift, Backtrace &mallocTrace)
+        {
+            return sizeof(ObjectData) + 2 * NumWords(NumGranules(size, granularityShift)) * sizeof(UINT64) +
+                    mallocTrace.GetStringBytes();
         }
 
         ADDRINT GetAddr() { return addr; }
 
         UINT32 GetSize() { return size; }
 
+        UINT32 GetGranularity() { return 1 << granularityShift; }
+
         THREADID GetMallocThread() { return mallocThread; } // NOT THREAD-SAFE
 
         THREADID GetFreeThread() { return freeThread; } // NOT THREAD-SAFE
 
         VOID SetFreeThread(THREADID freeThread) { this->freeThread = freeThread; } // NOT THREAD-SAFE
 
+        VOID SetFreeTime(UINT64 freeTime) { this->freeTime = freeTime; } // NOT THREAD-SAFE
+
+        UINT64 GetLifetime() { return freeTime - mallocTime; } // NOT THREAD-SAFE
+
+        UINT64 GetMallocTime() { return mallocTime; }
+
         VOID SetMallocTrace(Backtrace &b) { mallocTrace = b; } // NOT THREAD-SAFE
 
         VOID SetFreeTrace(CONTEXT *ctxt) { freeTrace.SetTrace(ctxt); } // NOT THREAD-SAFE
 
+        Backtrace &GetMallocTrace() { return mallocTrace; } // NOT THREAD-SAFE
+
+        Backtrace &GetFreeTrace() { return freeTrace; } // NOT THREAD-SAFE
+
+        // Whether the object was freed by its allocating thread before one of
+        // the functions in its malloc backtrace returned, i.e. it could have
+        // lived on that function's stack instead
+        //
+        BOOL IsFrameLocal() { return GetFrameLocalDepth() >= 0; } // NOT THREAD-SAFE
+
+        // Depth in the malloc backtrace of the innermost function whose stack
+        // the object could have lived on, or -1 if it isn't frame-local
+        //
+        INT32 GetFrameLocalDepth() // NOT THREAD-SAFE
+        {
+            if (freeThread != mallocThread)
+            {
+                return -1;
+            }
+            return mallocTrace.GetLiveFrameDepth(freeTrace);
+        }
+
         UINT32 GetNumReads() { return atomic_load(&numReads); }
 
         VOID IncrementNumReads() { atomic_fetch_add(&numReads, 1); }
@@ -85,42 +199,20 @@ class ObjectData
 
         VOID AddBytesWritten(UINT32 bytesWritten) { atomic_fetch_add(&(this->bytesWritten), bytesWritten); }
 
+        // Mark the granules touched by a read of readSize bytes at addrRead. When
+        // accessSize is non-zero it must equal readSize, and the common case of
+        // a byte-granularity object compiles down to one or two ORs
+        //
+        template <UINT32 accessSize>
         VOID UpdateReadCoverage(ADDRINT addrRead, UINT32 readSize)
         {
-            ADDRINT offset;
-
-            // Write to readBitmap at the same offset the object is being read
-            // TODO: We actually may not have to use a lock to modify readBitmap
-            // Maybe obtain an iterator to the desired element and modify it
-            // atomically?
-            //
-            offset = addrRead - addr;
-            for (ADDRINT i = offset; i < offset + readSize; i++)
-            {
-                PIN_GetLock(&readBitmapLock, -1);
-                if (i >= readBitmap.size()) { // Break if read exceeds size of bitmap
-                    PIN_ReleaseLock(&readBitmapLock);
-                    break; 
-                }
-                readBitmap[i] = 1;
-                PIN_ReleaseLock(&readBitmapLock);
-            }
+            UpdateCoverage<accessSize>(readBitmap, addrRead - addr, readSize);
         }
 
+        template <UINT32 accessSize>
         VOID UpdateWriteCoverage(ADDRINT addrWritten, UINT32 writeSize)
         {
-            ADDRINT offset;
-            offset = addrWritten - addr;
-            for (ADDRINT i = offset; i < offset + writeSize; i++)
-            {
-                PIN_GetLock(&writeBitmapLock, -1);
-                if (i >= writeBitmap.size()) {
-                    PIN_ReleaseLock(&writeBitmapLock);
-                    break; 
-                }
-                writeBitmap[i] = 1;
-                PIN_ReleaseLock(&writeBitmapLock);
-            }
+            UpdateCoverage<accessSize>(writeBitmap, addrWritten - addr, writeSize);
         }
 
         pair<Backtrace,Backtrace> GetTrace() // NOT THREAD-SAFE
@@ -129,16 +221,72 @@ class ObjectData
         }
 
     private:
+        static UINT32 NumGranules(UINT32 size, UINT32 granularityShift)
+        {
+            return (UINT32) (((UINT64) size + (1 << granularityShift) - 1) >> granularityShift);
+        }
+
+        static UINT32 NumWords(UINT32 numGranules) { return (numGranules + 63) / 64; }
+
+        template <UINT32 accessSize>
+        VOID UpdateCoverage(vector<UINT64> &bitmap, ADDRINT offset, UINT32 runtimeSize)
+        {
+            const UINT32 accessLength = accessSize != 0 ? accessSize : runtimeSize;
+            ADDRINT word, bit, first, last;
+
+            // A zero-length access (e.g. a scattered access with no elements
+            // enabled) touches nothing, and would wrap last around below
+            //
+            if (coverageDropped || accessLength == 0)
+            {
+                return;
+            }
+
+            // Byte granularity and an access that lies within the object: the bits
+            // to set are AccessMask<accessSize>::value shifted into place, spilling
+            // over into the next word at most once
+            //
+            if (accessSize != 0 && accessSize <= 64 && granularityShift == 0 && 
+                offset + accessLength <= numGranules)
+            {
+                word = offset >> 6;
+                bit = offset & 63;
+                bitmap[word] |= AccessMask<accessSize>::value << bit;
+                if (accessSize > 1 && bit + accessLength > 64)
+                {
+                    bitmap[word + 1] |= AccessMask<accessSize>::value >> (64 - bit);
+                }
+                return;
+            }
+
+            // Everything else (coarser granularity, unusual sizes, accesses running
+            // past the end of the object) sets the range granule by granule
+            //
+            first = offset >> granularityShift;
+            last = (offset + accessLength - 1) >> granularityShift;
+            if (last >= numGranules)
+            {
+                last = numGranules - 1;
+            }
+            for (ADDRINT i = first; i <= last && i < numGranules; i++)
+            {
+                bitmap[i >> 6] |= (UINT64) 1 << (i & 63);
+            }
+        }
+
         const ADDRINT addr;
         const UINT32 size;
+        const UINT32 granularityShift;
         atomic_int numReads, numWrites, bytesRead, bytesWritten;
         THREADID mallocThread, freeThread;
+        UINT64 mallocTime, freeTime;
+        BOOL coverageDropped;
         Backtrace mallocTrace, freeTrace;
-        vector<BOOL> readBitmap, writeBitmap;
-        PIN_LOCK readBitmapLock, writeBitmapLock;
+        const UINT32 numGranules;
+        vector<UINT64> readBitmap, writeBitmap;
 };
 
-ostream& operator<<(ostream& os, ObjectData& data) // NOT THREAD-SAFE
+JsonWriter& operator<<(JsonWriter& w, ObjectData& data) // NOT THREAD-SAFE
 {
     pair<double,double> coverage;
     pair<Backtrace,Backtrace> trace;
@@ -146,22 +294,37 @@ ostream& operator<<(ostream& os, ObjectData& data) // NOT THREAD-SAFE
     coverage = data.CalculateCoverage();
     trace = data.GetTrace();
 
-    os << "\t\t{" << endl <<
-            "\t\t\t\"address\" : " << data.GetAddr() << "," << endl << 
-            "\t\t\t\"size\" : " << data.GetSize() << "," << endl <<
-            "\t\t\t\"numReads\" : " << data.GetNumReads() << "," << endl <<
-            "\t\t\t\"numWrites\" : " << data.GetNumWrites() << "," << endl <<
-            "\t\t\t\"bytesRead\" : " << data.GetBytesRead() << "," << endl <<
-            "\t\t\t\"bytesWritten\" : " << data.GetBytesWritten() << "," << endl <<
-            "\t\t\t\"readCoverage\" : " << coverage.first << "," << endl <<
-            "\t\t\t\"writeCoverage\" : " << coverage.second << "," << endl <<
-            "\t\t\t\"allocatingThread\" : " << (INT32) data.GetMallocThread() << "," << endl <<
-            "\t\t\t\"freeingThread\" : " << (INT32) data.GetFreeThread() << "," << endl <<
-            "\t\t\t\"mallocBacktrace\" : " << trace.first << "," << endl <<
-            "\t\t\t\"freeBacktrace\" : " << trace.second << endl <<
-            "\t\t}";
-
-    return os;
+    w.BeginObject();
+    w.Key("address"); w.UInt(data.GetAddr());
+    w.Key("size"); w.UInt(data.GetSize());
+    w.Key("numReads"); w.UInt(data.GetNumReads());
+    w.Key("numWrites"); w.UInt(data.GetNumWrites());
+    w.Key("bytesRead"); w.UInt(data.GetBytesRead());
+    w.Key("bytesWritten"); w.UInt(data.GetBytesWritten());
+    w.Key("coverageGranularity"); w.UInt(data.GetGranularity());
+
+    // Coverage is reported as null when it was dropped to stay within the
+    // memory budget
+    //
+    if (data.IsCoverageDropped())
+    {
+        w.Key("readCoverage"); w.Null();
+        w.Key("writeCoverage"); w.Null();
+    }
+    else {
+        w.Key("readCoverage"); w.Double(coverage.first);
+        w.Key("writeCoverage"); w.Double(coverage.second);
+    }
+
+    w.Key("allocatingThread"); w.Int((INT32) data.GetMallocThread());
+    w.Key("freeingThread"); w.Int((INT32) data.GetFreeThread());
+    w.Key("lifetimeCycles"); w.UInt(data.GetLifetime());
+    w.Key("frameLocalDepth"); w.Int(data.GetFrameLocalDepth());
+    w.Key("mallocBacktrace"); w << trace.first;
+    w.Key("freeBacktrace"); w << trace.second;
+    w.EndObject();
+
+    return w;
 }
 
 #endif
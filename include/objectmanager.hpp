@@ -2,54 +2,174 @@
 #define __OBJECT_MANAGER_HPP
 
 #include "pin.H"
+#include <functional>
+#include <set>
 #include <unordered_map>
 #include <vector>
+#include "allocationprofile.hpp"
+#include "cycles.hpp"
+#include "jsonwriter.hpp"
+#include "metadataarena.hpp"
 
 using namespace std;
 
+// Coverage granularity used for new objects once the memory budget has been
+// reached (one bitmap entry per 8 bytes)
+//
+static const UINT32 coarseGranularityShift = 3;
+
+// Coverage granularities used for objects at or above the line and page
+// size thresholds (one bitmap entry per 64 and 4096 bytes respectively)
+//
+static const UINT32 lineGranularityShift = 6;
+static const UINT32 pageGranularityShift = 12;
+
+typedef pair<const ADDRINT,ObjectData*> LiveObjectsEntry;
+typedef unordered_map<ADDRINT,ObjectData*,hash<ADDRINT>,equal_to<ADDRINT>,
+                        ArenaAllocator<LiveObjectsEntry> > LiveObjectsMap;
+
+// Once the budget is reached, objects map each cache line that lies entirely
+// within them with a single liveObjects entry, keyed by the line's address
+//
+static const ADDRINT lineMask = ((ADDRINT) 1 << lineGranularityShift) - 1;
+
+// A node of liveObjects holds the entry and a pointer to the next node (hashes
+// of integer keys aren't cached)
+//
+static const size_t liveObjectsNodeBytes = sizeof(LiveObjectsEntry) + sizeof(VOID *);
+
+// A node of coveredObjects: a red-black tree node, its entry and the malloc
+// header in front of it
+//
+static const UINT64 coveredNodeBytes = 4 * sizeof(VOID *) + sizeof(pair<UINT32,ObjectData*>) + 2 * sizeof(VOID *);
+
 // All of ObjectManager's methods are thread-safe unless specified otherwise
 //
 class ObjectManager
 {
     public:
-        ObjectManager()
+        ObjectManager() :
+            liveObjects(0, hash<ADDRINT>(), equal_to<ADDRINT>(), ArenaAllocator<LiveObjectsEntry>(&arena)),
+            budgetBytes(0),
+            objectBytes(0),
+            peakBytes(0),
+            coveredBytes(0),
+            deadObjectsBytes(0),
+            profileBytes(0),
+            pendingNodes(0),
+            numLiveObjects(0),
+            numInheritedObjects(0),
+            forkTime(0),
+            samplePeriod(1),
+            degradedSamplePeriod(1),
+            numAllocations(0),
+            numUntracked(0),
+            numDroppedBitmaps(0),
+            budgetGranularityShift(0),
+            lineThreshold(0),
+            pageThreshold(0),
+            lineMapping(FALSE)
         {
             PIN_InitLock(&liveObjectsLock);
             PIN_InitLock(&deadObjectsLock);
+            PIN_InitLock(&budgetLock);
         }
 
-        VOID AddObject(ADDRINT ptr, UINT32 size, Backtrace trace, THREADID threadId)
+        // NOT THREAD-SAFE
+        // Limit the memory HeapShark spends on metadata to budgetBytes (0 means
+        // unlimited). Objects are then mapped per cache line rather than per
+        // byte (see FindObject()). Once the budget is reached we drop coverage
+        // bitmaps of the largest live objects, track coverage of new objects at
+        // a coarser granularity and finally only track one in every
+        // samplePeriod allocations
+        //
+        VOID SetBudget(UINT64 budgetBytes, UINT32 samplePeriod)
+        {
+            this->budgetBytes = budgetBytes;
+            lineMapping = budgetBytes > 0;
+            degradedSamplePeriod = samplePeriod == 0 ? 1 : samplePeriod;
+
+            // Slabs are charged to the budget as a whole, so a budget of only a
+            // few large pages is better spent on smaller slabs
+            //
+            if (budgetBytes > 0 && budgetBytes < 8 * arenaSlabSize)
+            {
+                arena.SetSlabSize(arenaSmallSlabSize);
+            }
+        }
+
+        // NOT THREAD-SAFE
+        // Objects of at least lineThreshold (pageThreshold) bytes have their
+        // coverage tracked per cache line (page) instead of per byte. A
+        // threshold of 0 disables that granularity
+        //
+        VOID SetGranularityThresholds(UINT32 lineThreshold, UINT32 pageThreshold)
+        {
+            this->lineThreshold = lineThreshold;
+            this->pageThreshold = pageThreshold;
+        }
+
+        // Returns false if the object was not tracked, either because it was
+        // sampled out or because tracking it would exceed the memory budget.
+        // profile must belong to the calling thread
+        //
+        BOOL AddObject(ADDRINT ptr, UINT32 size, Backtrace trace, THREADID threadId, AllocationProfile *profile)
         {
             ObjectData *d;
-            ADDRINT nextAddr;
+            UINT32 shift;
 
-            // We don't need to worry about recursive malloc calls since Pin doesn't instrument the Pintool itself
+            // Charge the object to the budget before creating it, along with all
+            // the room it will take up in liveObjects, deadObjects and profile
             //
-            d = new ObjectData(ptr, size, threadId);
-            d->SetMallocTrace(trace);
+            PIN_GetLock(&deadObjectsLock, threadId);
+            PIN_GetLock(&budgetLock, threadId);
+            if (!ReserveBudget(ptr, size, trace, profile, threadId))
+            {
+                numUntracked++;
+                PIN_ReleaseLock(&budgetLock);
+                PIN_ReleaseLock(&deadObjectsLock);
+                return false;
+            }
+            PIN_ReleaseLock(&deadObjectsLock);
+            shift = GranularityShiftFor(size);
 
-            // Create a mapping from every address in this object's range to the same ObjectData
+            // We don't need to worry about recursive malloc calls since Pin doesn't instrument the Pintool itself
             //
-            for (UINT32 i = 0; i < size; i++)
+            d = new ObjectData(ptr, size, threadId, shift);
+            d->SetMallocTrace(trace);
+            objectBytes += d->GetMetadataBytes();
+            if (budgetBytes > 0)
             {
-                nextAddr = (ptr + i);
-                PIN_GetLock(&liveObjectsLock, threadId);
-                liveObjects.insert(make_pair<ADDRINT,ObjectData*>(nextAddr, d));
-                PIN_ReleaseLock(&liveObjectsLock);
+                coveredObjects.insert(make_pair(size, d));
+                coveredBytes += d->GetCoverageBytes();
+                objectBytes += coveredNodeBytes;
             }
+            PIN_ReleaseLock(&budgetLock);
+
+            MapObject(d, threadId);
+
+            PIN_GetLock(&budgetLock, threadId);
+            pendingNodes -= GetNumNodes(ptr, size);
+            UpdatePeak(threadId);
+            PIN_ReleaseLock(&budgetLock);
+            return true;
         }
 
-        VOID RemoveObject(ADDRINT ptr, CONTEXT *ctxt, THREADID threadId)
+        // The freed object is recorded in profile, which must belong to the
+        // calling thread
+        //
+        VOID RemoveObject(ADDRINT ptr, CONTEXT *ctxt, THREADID threadId, AllocationProfile *profile)
         {
-            unordered_map<ADDRINT,ObjectData*>::iterator it;
+            LiveObjectsMap::iterator it;
             ObjectData *d;
-            ADDRINT startAddr, endAddr;
+            UINT64 traceBytes, siteBytes;
+            BOOL createSite, inherited;
 
             // Determine if this is an invalid/double free, and if it is, then 
             // skip this routine
             //
             PIN_GetLock(&liveObjectsLock, threadId);
-            it = liveObjects.find(ptr);
+            it = FindObject(ptr);
             if (it == liveObjects.end())
             {
                 PIN_ReleaseLock(&liveObjectsLock);
@@ -58,30 +178,72 @@ class ObjectManager
             PIN_ReleaseLock(&liveObjectsLock);
     
             // Set the backtrace for free() in the corresponding object, and 
-            // insert the object into deadObjects
+            // insert the object into deadObjects, unless it was inherited from
+            // a parent process. The parent writes those out, the child only
+            // counts them
             //
             d = it->second;
+            traceBytes = d->GetTraceBytes();
             d->SetFreeThread(threadId);
             d->SetFreeTrace(ctxt);
-            PIN_GetLock(&deadObjectsLock, threadId);
-            deadObjects.push_back(d);
-            PIN_ReleaseLock(&deadObjectsLock);
+            d->SetFreeTime(ReadCycles());
 
-            // Remove all mappings corresponding to this object
+            // Take d out of coveredObjects before profiling it, which reads its
+            // bitmaps, so that ReserveBudget() can no longer drop them. A site
+            // this thread hasn't profiled yet is only added if there is room
+            // for it in the budget
             //
-            startAddr = d->GetAddr();
-            endAddr = startAddr + d->GetSize();
-            while (startAddr != endAddr)
+            PIN_GetLock(&budgetLock, threadId);
+            if (budgetBytes > 0 && coveredObjects.erase(make_pair(d->GetSize(), d)) > 0)
             {
-                PIN_GetLock(&liveObjectsLock, threadId);
-                liveObjects.erase(startAddr++);
-                PIN_ReleaseLock(&liveObjectsLock);
+                coveredBytes -= d->GetCoverageBytes();
+                objectBytes -= coveredNodeBytes;
+            }
+            createSite = budgetBytes == 0 || GetTrackerBytes(threadId) + profile->EstimateSiteBytes(d->GetMallocTrace()) <= budgetBytes;
+            inherited = d->GetMallocTime() < forkTime;
+            PIN_ReleaseLock(&budgetLock);
+
+            siteBytes = profile->GetSiteBytes();
+            if (!inherited)
+            {
+                profile->Record(*d, createSite);
+            }
+
+            PIN_GetLock(&budgetLock, threadId);
+            profileBytes += profile->GetSiteBytes() - siteBytes;
+            objectBytes += d->GetTraceBytes() - traceBytes;
+            if (inherited)
+            {
+                numInheritedObjects++;
+            }
+            else {
+                numLiveObjects--;
+            }
+            PIN_ReleaseLock(&budgetLock);
+
+            // ReserveBudget() made sure deadObjects has room for d
+            //
+            if (!inherited)
+            {
+                PIN_GetLock(&deadObjectsLock, threadId);
+                deadObjects.push_back(d);
+                PIN_ReleaseLock(&deadObjectsLock);
+            }
+
+            UnmapObject(d, threadId);
+            if (inherited)
+            {
+                ReleaseObject(d);
             }
         }
 
+        // accessSize is either 0, or a compile-time copy of readSize that lets
+        // the coverage update be specialized for that size
+        //
+        template <UINT32 accessSize>
         BOOL ReadObject(ADDRINT addrRead, UINT32 readSize, THREADID threadId)
         {
-            unordered_map<ADDRINT,ObjectData*>::iterator it;
+            LiveObjectsMap::iterator it;
             ObjectData *d;
 
             // Determine whether addrRead corresponds to an object returned by malloc, 
@@ -91,43 +253,47 @@ class ObjectManager
             // Need a better way of doing this without using an unordered_map...
             //
             PIN_GetLock(&liveObjectsLock, threadId);
-            it = liveObjects.find(addrRead);
+            it = FindObject(addrRead);
             if (it == liveObjects.end())
             {
                 PIN_ReleaseLock(&liveObjectsLock);
                 return false;
             }
-            PIN_ReleaseLock(&liveObjectsLock);
 
-            // Update corresponding object's data (no locks are needed here since
-            // all of ObjectData's methods are thread-safe
+            // Coverage is updated while we still hold liveObjectsLock, which also
+            // keeps the bitmaps from being dropped underneath us
             //
             d = it->second;
+            d->UpdateReadCoverage<accessSize>(addrRead, readSize);
+            PIN_ReleaseLock(&liveObjectsLock);
+
+            // Counters are atomic, so no locks are needed here
+            //
             d->IncrementNumReads();
-            d->AddBytesRead(readSize);
-            d->UpdateReadCoverage(addrRead, readSize);
+            d->AddBytesRead(accessSize != 0 ? accessSize : readSize);
 
             return true;
         }
 
+        template <UINT32 accessSize>
         BOOL WriteObject(ADDRINT addrWritten, UINT32 writeSize, THREADID threadId)
         {
-            unordered_map<ADDRINT,ObjectData*>::iterator it;
+            LiveObjectsMap::iterator it;
             ObjectData *d;
 
             PIN_GetLock(&liveObjectsLock, threadId);
-            it = liveObjects.find(addrWritten);
+            it = FindObject(addrWritten);
             if (it == liveObjects.end())
             {
                 PIN_ReleaseLock(&liveObjectsLock);
                 return false;
             }
+            d = it->second;
+            d->UpdateWriteCoverage<accessSize>(addrWritten, writeSize);
             PIN_ReleaseLock(&liveObjectsLock);
 
-            d = it->second;
             d->IncrementNumWrites();
-            d->AddBytesWritten(writeSize);
-            d->UpdateWriteCoverage(addrWritten, writeSize);
+            d->AddBytesWritten(accessSize != 0 ? accessSize : writeSize);
 
             return true;
         }
@@ -135,11 +301,11 @@ class ObjectManager
         // NOT THREAD-SAFE
         // Move objects that were never freed to totalObjects
         // Only called at the end of the application in case objects were
-        // never freed
+        // never freed. They are recorded in profile
         // 
-        VOID KillLiveObjects()
+        VOID KillLiveObjects(AllocationProfile *profile)
         {
-            unordered_map<ADDRINT,ObjectData*>::iterator it;
+            LiveObjectsMap::iterator it;
 
             while (liveObjects.size() > 0)
             {
@@ -148,14 +314,14 @@ class ObjectManager
                 // Remember that liveObjects contains pointers within objects as well,
                 // so all we really need to free is the base address of the object
                 //
-                RemoveObject(it->second->GetAddr(), nullptr, -1);
+                RemoveObject(it->second->GetAddr(), nullptr, -1, profile);
             }
         }
 
-        // Write out contents of deadObjects to os and empty deadObjects
+        // Write out contents of deadObjects to w and empty deadObjects
         // if deadObjects.size() >= sizeThreshold
         //
-        VOID ClearDeadObjects(ostream& os, UINT32 sizeThreshold)
+        VOID ClearDeadObjects(JsonWriter& w, UINT32 sizeThreshold)
         {
             vector<ObjectData*>::iterator it;
 
@@ -170,37 +336,488 @@ class ObjectManager
                 // Written out in reverse order to take advantage of pop_back
                 //
                 it = deadObjects.end() - 1;
-                os << **it << "," << endl;
-                delete *it;
+                w << **it;
+                ReleaseObject(*it);
                 deadObjects.pop_back();
             }
             PIN_ReleaseLock(&deadObjectsLock);
         }
 
+        // Whether HeapShark's metadata has reached the memory budget
+        //
+        BOOL IsOverBudget()
+        {
+            BOOL overBudget;
+
+            if (budgetBytes == 0)
+            {
+                return false;
+            }
+            PIN_GetLock(&budgetLock, -1);
+            overBudget = GetTrackerBytes(-1) >= budgetBytes;
+            PIN_ReleaseLock(&budgetLock);
+            return overBudget;
+        }
+
+        // Account for profiling state held outside of the profiles passed to
+        // AddObject() and RemoveObject(), e.g. per-thread state or the summary
+        // that profiles of exited threads are folded into, which went from
+        // oldBytes to newBytes
+        //
+        VOID UpdateProfileBytes(UINT64 oldBytes, UINT64 newBytes, THREADID threadId)
+        {
+            PIN_GetLock(&budgetLock, threadId);
+            profileBytes += newBytes - oldBytes;
+            UpdatePeak(threadId);
+            PIN_ReleaseLock(&budgetLock);
+        }
+
+        // NOT THREAD-SAFE
+        // Write a summary of HeapShark's own memory usage to w
+        //
+        VOID PrintTrackerMemory(JsonWriter &w)
+        {
+            w.BeginObject();
+            w.Key("budgetBytes"); w.UInt(budgetBytes);
+            w.Key("peakBytes"); w.UInt(peakBytes);
+            w.Key("hugePages"); w.Bool(arena.UsesHugePages());
+            w.Key("droppedBitmaps"); w.UInt(numDroppedBitmaps);
+            w.Key("coarseGranularity"); w.Bool(budgetGranularityShift > 0);
+            w.Key("samplePeriod"); w.UInt(samplePeriod);
+            w.Key("allocations"); w.UInt(numAllocations);
+            w.Key("untrackedAllocations"); w.UInt(numUntracked);
+            w.EndObject();
+        }
+
         // NOT THREAD-SAFE
         // This method is only called upon program termination
         //
         vector<ObjectData*> *GetDeadObjects() { return &deadObjects; }
 
+        // NOT THREAD-SAFE
+        // Number of objects allocated by a parent process that were freed in
+        // this one, or still live when it terminated
+        //
+        UINT64 GetNumInheritedObjects() { return numInheritedObjects; }
+
+        // Called in the parent right before fork(), so that no other thread holds
+        // one of our locks when the child's copy of ObjectManager is made
+        //
+        VOID LockForFork(THREADID threadId)
+        {
+            PIN_GetLock(&deadObjectsLock, threadId);
+            PIN_GetLock(&budgetLock, threadId);
+            PIN_GetLock(&liveObjectsLock, threadId);
+        }
+
+        // Called in the parent right after fork()
+        //
+        VOID UnlockAfterFork()
+        {
+            PIN_ReleaseLock(&liveObjectsLock);
+            PIN_ReleaseLock(&budgetLock);
+            PIN_ReleaseLock(&deadObjectsLock);
+        }
+
+        // NOT THREAD-SAFE
+        // Called in the child right after fork(), when it is still single-threaded.
+        // Dead objects are the parent's to write out, so they are dropped. Live
+        // objects are kept, since the child may access and free them, but they
+        // are only counted (see RemoveObject())
+        //
+        VOID ResetAfterFork()
+        {
+            vector<ObjectData*>::iterator it;
+
+            PIN_InitLock(&liveObjectsLock);
+            PIN_InitLock(&deadObjectsLock);
+            PIN_InitLock(&budgetLock);
+
+            for (it = deadObjects.begin(); it != deadObjects.end(); it++)
+            {
+                ReleaseObject(*it);
+            }
+            vector<ObjectData*>().swap(deadObjects);
+            deadObjectsBytes = 0;
+            numLiveObjects = 0; // Every live object is inherited now
+            numInheritedObjects = 0;
+
+            // The child's only thread starts out with an empty profile, and
+            // no other thread is in the middle of adding an object
+            //
+            profileBytes = 0;
+            pendingNodes = 0;
+            peakBytes = GetTrackerBytes(-1);
+            samplePeriod = 1;
+            numAllocations = numUntracked = numDroppedBitmaps = 0;
+            forkTime = ReadCycles();
+        }
+
     private:
-        unordered_map<ADDRINT,ObjectData*> liveObjects;
+        // liveObjectsLock must be held. Every byte of an object is found under
+        // its own address, except with lineMapping, where each cache line that
+        // lies entirely within an object is found under the address of the line.
+        // That costs a second lookup for addresses outside of those lines, but
+        // cuts the nodes of large objects 64-fold and loses nothing. The start
+        // of a line may instead be a byte of another object, hence the bounds
+        // check
+        //
+        LiveObjectsMap::iterator FindObject(ADDRINT addr)
+        {
+            LiveObjectsMap::iterator it;
+
+            it = liveObjects.find(addr);
+            if (it != liveObjects.end() || !lineMapping)
+            {
+                return it;
+            }
+            it = liveObjects.find(addr & ~lineMask);
+            if (it != liveObjects.end() && addr - it->second->GetAddr() >= it->second->GetSize())
+            {
+                return liveObjects.end();
+            }
+            return it;
+        }
+
+        // The whole cache lines [lineStart, lineEnd) of an object, or an empty
+        // range at its end without lineMapping or if it has none
+        //
+        VOID GetFullLines(ADDRINT ptr, UINT32 size, ADDRINT &lineStart, ADDRINT &lineEnd)
+        {
+            lineStart = (ptr + lineMask) & ~lineMask;
+            lineEnd = (ptr + size) & ~lineMask;
+            if (!lineMapping || lineStart >= lineEnd)
+            {
+                lineStart = lineEnd = ptr + size;
+            }
+        }
+
+        // Number of liveObjects entries an object takes up
+        //
+        UINT64 GetNumNodes(ADDRINT ptr, UINT32 size)
+        {
+            ADDRINT lineStart, lineEnd;
+
+            GetFullLines(ptr, size, lineStart, lineEnd);
+            return size - (lineEnd - lineStart) + ((lineEnd - lineStart) >> lineGranularityShift);
+        }
+
+        // Key of the liveObjects entry that covers addr, returning the address
+        // right after the bytes that entry covers
+        //
+        static ADDRINT NextKey(ADDRINT addr, ADDRINT lineStart, ADDRINT lineEnd, ADDRINT &key)
+        {
+            key = addr;
+            if (addr >= lineStart && addr < lineEnd)
+            {
+                return addr + lineMask + 1;
+            }
+            return addr + 1;
+        }
+
+        // Create a mapping from every address in this object's range to the same ObjectData
+        //
+        VOID MapObject(ObjectData *d, THREADID threadId)
+        {
+            ADDRINT addr, nextAddr, endAddr, lineStart, lineEnd, key;
+
+            GetFullLines(d->GetAddr(), d->GetSize(), lineStart, lineEnd);
+            endAddr = d->GetAddr() + d->GetSize();
+            for (addr = d->GetAddr(); addr != endAddr; addr = nextAddr)
+            {
+                nextAddr = NextKey(addr, lineStart, lineEnd, key);
+                PIN_GetLock(&liveObjectsLock, threadId);
+                liveObjects.insert(make_pair(key, d));
+                PIN_ReleaseLock(&liveObjectsLock);
+            }
+        }
+
+        // Remove all mappings corresponding to this object
+        //
+        VOID UnmapObject(ObjectData *d, THREADID threadId)
+        {
+            ADDRINT addr, nextAddr, endAddr, lineStart, lineEnd, key;
+
+            GetFullLines(d->GetAddr(), d->GetSize(), lineStart, lineEnd);
+            endAddr = d->GetAddr() + d->GetSize();
+            for (addr = d->GetAddr(); addr != endAddr; addr = nextAddr)
+            {
+                nextAddr = NextKey(addr, lineStart, lineEnd, key);
+                PIN_GetLock(&liveObjectsLock, threadId);
+                liveObjects.erase(key);
+                PIN_ReleaseLock(&liveObjectsLock);
+            }
+        }
+
+        // budgetLock must be held for all of the following private methods
+        //
+        UINT64 GetTrackerBytes(THREADID threadId)
+        {
+            UINT64 arenaBytes;
+
+            PIN_GetLock(&liveObjectsLock, threadId);
+            arenaBytes = arena.GetMappedBytes();
+            PIN_ReleaseLock(&liveObjectsLock);
+            return arenaBytes + objectBytes + deadObjectsBytes + profileBytes;
+        }
+
+        VOID UpdatePeak(THREADID threadId)
+        {
+            UINT64 trackerBytes;
+
+            trackerBytes = GetTrackerBytes(threadId);
+            if (trackerBytes > peakBytes)
+            {
+                peakBytes = trackerBytes;
+            }
+        }
+
+        // Decide whether an object of the given size can be tracked, degrading
+        // coverage tracking if the memory budget has been reached. If it can,
+        // make room for it (see Grow()). deadObjectsLock must be held as well
+        //
+        BOOL ReserveBudget(ADDRINT ptr, UINT32 size, Backtrace &trace, AllocationProfile *profile, THREADID threadId)
+        {
+            UINT64 cost, trackerBytes, nodes;
+            set<pair<UINT32,ObjectData*> >::iterator it;
+
+            if (numAllocations++ % samplePeriod != 0)
+            {
+                return false;
+            }
+            nodes = GetNumNodes(ptr, size);
+            if (budgetBytes == 0)
+            {
+                Grow(nodes, trace, profile, threadId);
+                return true;
+            }
+
+            cost = EstimateCost(size, nodes, trace, profile, threadId);
+            trackerBytes = GetTrackerBytes(threadId);
+            if (trackerBytes + cost <= budgetBytes)
+            {
+                // Back under the budget, so stop sampling if we were
+                //
+                samplePeriod = 1;
+                Grow(nodes, trace, profile, threadId);
+                return true;
+            }
+
+            // Degrade gracefully: coarsen coverage for new objects, then drop
+            // the bitmaps of the largest live objects until the new one fits
+            //
+            if (budgetGranularityShift < coarseGranularityShift)
+            {
+                budgetGranularityShift = coarseGranularityShift;
+                cost = EstimateCost(size, nodes, trace, profile, threadId);
+            }
+
+            // Dropping every bitmap gives back at most coveredBytes. An object
+            // that wouldn't fit even then isn't tracked, and everything else
+            // keeps its coverage. Only once not even the smallest object fits
+            // do we fall back to sampling allocations
+            //
+            if (trackerBytes - coveredBytes + cost > budgetBytes)
+            {
+                if (trackerBytes - coveredBytes + EstimateCost(1, 1, trace, profile, threadId) > budgetBytes)
+                {
+                    samplePeriod = degradedSamplePeriod;
+                }
+                return false;
+            }
+            while (trackerBytes + cost > budgetBytes && !coveredObjects.empty())
+            {
+                it = --coveredObjects.end();
+                objectBytes -= it->second->GetMetadataBytes() + coveredNodeBytes;
+                coveredBytes -= it->second->GetCoverageBytes();
+                PIN_GetLock(&liveObjectsLock, threadId);
+                it->second->DropCoverage();
+                PIN_ReleaseLock(&liveObjectsLock);
+                objectBytes += it->second->GetMetadataBytes();
+                coveredObjects.erase(it);
+                numDroppedBitmaps++;
+                trackerBytes = GetTrackerBytes(threadId);
+            }
+            if (trackerBytes + cost > budgetBytes)
+            {
+                return false;
+            }
+            Grow(nodes, trace, profile, threadId);
+            return true;
+        }
+
+        // Metadata that tracking an object of the given size, taking up nodes
+        // entries in liveObjects, would add, including whatever liveObjects,
+        // deadObjects and profile would have to grow by. Growing a container briefly needs its old and new
+        // storage at the same time, so the new storage is charged in full
+        //
+        UINT64 EstimateCost(UINT32 size, UINT64 nodes, Backtrace &trace, AllocationProfile *profile, THREADID threadId)
+        {
+            UINT64 cost, nodeBytes, availableBytes, pendingBytes, target;
+
+            // Nodes are recycled within the arena, and when it runs out it maps whole slabs.
+            // Room that other threads have reserved (pendingNodes) but not
+            // filled yet isn't available to this object
+            //
+            PIN_GetLock(&liveObjectsLock, threadId);
+            nodeBytes = nodes * arena.GetBlockSize(liveObjectsNodeBytes);
+            availableBytes = arena.GetAvailableBytes(liveObjectsNodeBytes);
+            pendingBytes = pendingNodes * arena.GetBlockSize(liveObjectsNodeBytes);
+            availableBytes = availableBytes > pendingBytes ? availableBytes - pendingBytes : 0;
+            cost = 0;
+            if (nodeBytes > availableBytes)
+            {
+                cost = (nodeBytes - availableBytes + arena.GetSlabSize() - 1) / arena.GetSlabSize() * arena.GetSlabSize();
+            }
+            target = liveObjects.size() + pendingNodes + nodes;
+            if (target > GetLiveObjectsCapacity())
+            {
+                // After reserve() there are at most 5/4 as many buckets as needed
+                //
+                cost += arena.GetBlockSize((size_t) (GrowLiveObjectsCapacity(target) / liveObjects.max_load_factor() * 5 / 4 + 1) * sizeof(VOID *));
+            }
+            PIN_ReleaseLock(&liveObjectsLock);
+
+            if (numLiveObjects + deadObjects.size() + 1 > deadObjects.capacity())
+            {
+                cost += GrowDeadObjectsCapacity() * sizeof(ObjectData*);
+            }
+            cost += profile->EstimateSiteBytes(trace);
+            if (budgetBytes > 0)
+            {
+                cost += coveredNodeBytes;
+            }
+            return cost + ObjectData::EstimateMetadataBytes(size, GranularityShiftFor(size), trace);
+        }
+
+        // Make room for a new object taking up nodes entries ahead of time, so that
+        // adding it (and later freeing it) can't grow anything behind the
+        // budget's back: liveObjects gets enough buckets for its nodes,
+        // deadObjects room for it once it's freed and profile its site
+        //
+        VOID Grow(UINT64 nodes, Backtrace &trace, AllocationProfile *profile, THREADID threadId)
+        {
+            UINT64 target, siteBytes;
+
+            PIN_GetLock(&liveObjectsLock, threadId);
+            target = liveObjects.size() + pendingNodes + nodes;
+            if (target > GetLiveObjectsCapacity())
+            {
+                liveObjects.reserve(GrowLiveObjectsCapacity(target));
+            }
+            PIN_ReleaseLock(&liveObjectsLock);
+            pendingNodes += nodes;
+
+            if (numLiveObjects + deadObjects.size() + 1 > deadObjects.capacity())
+            {
+                deadObjects.reserve(GrowDeadObjectsCapacity());
+                deadObjectsBytes = deadObjects.capacity() * sizeof(ObjectData*);
+            }
+            numLiveObjects++;
+
+            siteBytes = profile->GetSiteBytes();
+            profile->FindSite(trace, TRUE);
+            profileBytes += profile->GetSiteBytes() - siteBytes;
+        }
+
+        // Number of entries liveObjects can hold without rehashing
+        //
+        UINT64 GetLiveObjectsCapacity()
+        {
+            return (UINT64) (liveObjects.bucket_count() * liveObjects.max_load_factor());
+        }
+
+        // Containers grow at least geometrically so that reserving room ahead
+        // of time doesn't turn into a rehash/reallocation per object. Once
+        // doubling the buckets of liveObjects would take up more than an eighth
+        // of the budget, they grow by an eighth instead
+        //
+        UINT64 GrowLiveObjectsCapacity(UINT64 target)
+        {
+            UINT64 capacity, growth;
+
+            capacity = GetLiveObjectsCapacity();
+            growth = capacity;
+            if (budgetBytes > 0 && 2 * liveObjects.bucket_count() * sizeof(VOID *) > budgetBytes / 8)
+            {
+                growth = capacity / 8;
+            }
+            return target > capacity + growth ? target : capacity + growth;
+        }
+
+        UINT64 GrowDeadObjectsCapacity()
+        {
+            UINT64 target;
+
+            target = numLiveObjects + deadObjects.size() + 1;
+            return target > 2 * deadObjects.capacity() ? target : 2 * deadObjects.capacity();
+        }
+
+        // Byte-exact coverage for small objects, cache-line or page coverage
+        // for large ones, and never finer than the budget allows
+        //
+        UINT32 GranularityShiftFor(UINT32 size)
+        {
+            UINT32 shift;
+
+            shift = 0;
+            if (pageThreshold > 0 && size >= pageThreshold)
+            {
+                shift = pageGranularityShift;
+            }
+            else if (lineThreshold > 0 && size >= lineThreshold)
+            {
+                shift = lineGranularityShift;
+            }
+            return shift > budgetGranularityShift ? shift : budgetGranularityShift;
+        }
+
+        VOID ReleaseObject(ObjectData *d)
+        {
+            PIN_GetLock(&budgetLock, -1);
+            objectBytes -= d->GetMetadataBytes();
+            PIN_ReleaseLock(&budgetLock);
+            delete d;
+        }
+
+        MetadataArena arena; // Must be declared before liveObjects
+        LiveObjectsMap liveObjects;
         vector<ObjectData*> deadObjects;
-        PIN_LOCK liveObjectsLock, deadObjectsLock;
+        PIN_LOCK liveObjectsLock, deadObjectsLock, budgetLock;
+
+        // The following are guarded by budgetLock
+        //
+        UINT64 budgetBytes, objectBytes, peakBytes;
+        UINT64 coveredBytes; // Bitmap bytes of the objects in coveredObjects
+        UINT64 deadObjectsBytes, profileBytes; // Storage of deadObjects, profiling state of all threads
+        UINT64 pendingNodes; // Nodes reserved in liveObjects but not inserted yet
+        UINT64 numLiveObjects; // Tracked objects that haven't been freed, excluding inherited ones
+        UINT64 numInheritedObjects;
+        UINT64 forkTime; // When this process was forked, 0 if it wasn't
+        UINT32 samplePeriod, degradedSamplePeriod;
+        UINT64 numAllocations, numUntracked, numDroppedBitmaps;
+        UINT32 budgetGranularityShift;
+        UINT32 lineThreshold, pageThreshold;
+        BOOL lineMapping; // Set along with the budget, see FindObject()
+
+        // Live objects that still have coverage bitmaps, ordered by size so
+        // that the largest can be dropped first. Only kept when a budget is set
+        //
+        set<pair<UINT32,ObjectData*> > coveredObjects;
 };
 
-ostream& operator<<(ostream &os, ObjectManager& manager) // NOT THREAD-SAFE
+JsonWriter& operator<<(JsonWriter &w, ObjectManager& manager) // NOT THREAD-SAFE
 {
     vector<ObjectData*> *deadObjects;
     vector<ObjectData*>::iterator it;
 
     deadObjects = manager.GetDeadObjects();
-    for (it = deadObjects->begin(); it != deadObjects->end() - 1; it++)
+    for (it = deadObjects->begin(); it != deadObjects->end(); it++)
     {
-        os << **it << "," << endl;
+        w << **it;
     }
-    os << **it;
 
-    return os;
+    return w;
 }
 
 #endif
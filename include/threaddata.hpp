@@ -0,0 +1,58 @@
+#ifndef __THREAD_DATA_HPP
+#define __THREAD_DATA_HPP
+
+#include "pin.H"
+#include "allocationprofile.hpp"
+#include "backtrace.hpp"
+#include "cycles.hpp"
+
+using namespace std;
+
+// Everything HeapShark keeps per thread, stored in the thread's TLS slot
+//
+// Nothing within ThreadData is thread-safe since it is only ever accessed by
+// its own thread, except after the application has terminated
+//
+class ThreadData
+{
+    public:
+        ThreadData(THREADID threadId) : threadId(threadId), mallocSize(0), mallocStart(0), freeStart(0) { }
+
+        THREADID GetThreadId() { return threadId; }
+
+        // Function arguments and backtrace of the malloc call in progress,
+        // cached until malloc returns
+        //
+        VOID SetMallocArgs(CONTEXT *ctxt, ADDRINT size)
+        {
+            mallocTrace.SetTrace(ctxt);
+            mallocSize = size;
+        }
+
+        ADDRINT GetMallocSize() { return mallocSize; }
+
+        Backtrace &GetMallocTrace() { return mallocTrace; }
+
+        AllocationProfile &GetProfile() { return profile; }
+
+        // Cycles spent inside malloc/free, measured from the end of the hook
+        // before the call to the start of the hook after it, so that time
+        // spent in HeapShark's own bookkeeping isn't included
+        //
+        VOID StartMalloc() { mallocStart = ReadCycles(); }
+
+        UINT64 StopMalloc() { return ReadCycles() - mallocStart; }
+
+        VOID StartFree() { freeStart = ReadCycles(); }
+
+        UINT64 StopFree() { return ReadCycles() - freeStart; }
+
+    private:
+        THREADID threadId;
+        ADDRINT mallocSize;
+        UINT64 mallocStart, freeStart;
+        Backtrace mallocTrace;
+        AllocationProfile profile;
+};
+
+#endif
@@ -1,21 +1,30 @@
 #include "pin.H"
-#include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <utility>
 #include <cstdio>
 #include <cstdlib>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "objectdata.hpp"
 #include "backtrace.hpp"
 #include "objectmanager.hpp"
+#include "jsonwriter.hpp"
+#include "allocationprofile.hpp"
+#include "threaddata.hpp"
+#include "cycles.hpp"
 
 #ifdef TARGET_MAC
 #define MALLOC "_malloc"
 #define FREE "_free"
+#define ROI_START "_HEAPSHARK_START"
+#define ROI_STOP "_HEAPSHARK_STOP"
 #else
 #define MALLOC "malloc"
 #define FREE "free"
+#define ROI_START "HEAPSHARK_START"
+#define ROI_STOP "HEAPSHARK_STOP"
 #endif // TARGET_MAC
 
 #ifdef HEAP_SHARK_DEBUG
@@ -31,27 +40,140 @@ static PIN_LOCK updateOutputLock;
 
 using namespace std;
 
-static ofstream traceFile;
+static JsonWriter traceFile;
 static KNOB<string> knobOutputFile(KNOB_MODE_WRITEONCE, "pintool", "o", "heapshark.json", "specify profiling file name");
+static KNOB<UINT64> knobBudget(KNOB_MODE_WRITEONCE, "pintool", "budget", "0", "limit HeapShark's metadata to this many MB (0 for unlimited)");
+static KNOB<UINT32> knobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool", "sample_period", "64", "track one in every n allocations once the memory budget is exhausted");
+static KNOB<UINT32> knobLineThreshold(KNOB_MODE_WRITEONCE, "pintool", "line_threshold", "4096", "track coverage per cache line for objects of at least this many bytes (0 to disable)");
+static KNOB<UINT32> knobPageThreshold(KNOB_MODE_WRITEONCE, "pintool", "page_threshold", "1048576", "track coverage per page for objects of at least this many bytes (0 to disable)");
+static KNOB<BOOL> knobRoi(KNOB_MODE_WRITEONCE, "pintool", "roi", "0", "only profile memory accesses after the application calls HEAPSHARK_START()");
+static KNOB<UINT64> knobSkipAllocs(KNOB_MODE_WRITEONCE, "pintool", "skip_allocs", "0", "only profile memory accesses after this many allocations");
+static KNOB<UINT64> knobSkipIns(KNOB_MODE_WRITEONCE, "pintool", "skip_ins", "0", "only profile memory accesses after this many instructions");
+static KNOB<UINT64> knobStackLimit(KNOB_MODE_WRITEONCE, "pintool", "stack_limit", "4096", "flag stack allocation candidates larger than this many bytes");
+static KNOB<UINT32> knobMaxSites(KNOB_MODE_WRITEONCE, "pintool", "max_sites", "4096", "profile at most this many call sites per thread");
+static KNOB<UINT32> knobStackTop(KNOB_MODE_WRITEONCE, "pintool", "stack_top", "10", "report this many stack allocation candidates (0 for all)");
 static ObjectManager manager;
+static vector<ThreadData*> allThreadData; // Threads that haven't exited yet
+static ProfileSummary summary; // Profiles of the threads that exited, then of all of them in Fini
+static PIN_LOCK allThreadDataLock; // Protects allThreadData and summary
+static AllocationProfile exitProfile; // Objects that are still live when the application terminates
 static INT32 numThreads = 0;
 static TLS_KEY tls_key = INVALID_TLS_KEY; // Thread Local Storage
+static INT32 pid = -1, parentPid = -1; // parentPid is only set in forked children
+
+// Region of interest: memory accesses are only instrumented while the
+// application is between HEAPSHARK_START() and HEAPSHARK_STOP() and past the
+// first skipAllocs allocations and skipIns instructions. malloc and free are
+// always tracked so that objects allocated outside the region are still known
+//
+static PIN_LOCK roiLock;
+static BOOL roiMarkerOpen, roiActive;
+static BOOL roiStartFound; // Whether any image defines HEAPSHARK_START()
+static UINT64 skipAllocs, skipIns;
+static atomic_ullong numAllocsSeen, numInsSeen;
+
+// Re-evaluate whether we're inside the region of interest, and if that changed
+// (or reinstrument is set), throw away all instrumentation so that Instruction()
+// and Trace() re-instrument accordingly. Must be called with roiLock held
+//
+VOID EvaluateRoi(BOOL reinstrument)
+{
+    BOOL active;
+
+    active = roiMarkerOpen && 
+                atomic_load(&numAllocsSeen) >= skipAllocs && 
+                atomic_load(&numInsSeen) >= skipIns;
+    if (active != roiActive || reinstrument)
+    {
+        PDEBUG("HeapShark: %s region of interest\n", active ? "entering" : "leaving");
+        roiActive = active;
+        PIN_RemoveInstrumentation();
+    }
+}
+
+VOID UpdateRoi(THREADID threadId, BOOL reinstrument)
+{
+    PIN_GetLock(&roiLock, threadId);
+    EvaluateRoi(reinstrument);
+    PIN_ReleaseLock(&roiLock);
+}
+
+// roiMarkerOpen is only written under roiLock, so that a thread that
+// re-evaluates the region concurrently can't act on a stale value
+//
+VOID SetRoiMarker(THREADID threadId, BOOL open)
+{
+    PIN_GetLock(&roiLock, threadId);
+    roiMarkerOpen = open;
+    EvaluateRoi(FALSE);
+    PIN_ReleaseLock(&roiLock);
+}
+
+VOID RoiStart(THREADID threadId)
+{
+    SetRoiMarker(threadId, TRUE);
+}
+
+VOID RoiStop(THREADID threadId)
+{
+    SetRoiMarker(threadId, FALSE);
+}
+
+// Only the block that completes the skip does anything beyond counting. It
+// throws away the counting instrumentation even if the region of interest
+// doesn't become active yet (e.g. HEAPSHARK_START() hasn't been called)
+//
+VOID CountInstructions(THREADID threadId, UINT32 numIns)
+{
+    UINT64 seen;
+
+    seen = atomic_fetch_add(&numInsSeen, numIns);
+    if (seen < skipIns && seen + numIns >= skipIns)
+    {
+        UpdateRoi(threadId, TRUE);
+    }
+}
 
 VOID ThreadStart(THREADID threadId, CONTEXT *ctxt, INT32 flags, VOID* v)
 {
     numThreads++;
-    pair<ADDRINT, Backtrace> *threadCache = new pair<ADDRINT, Backtrace>();
-    if (PIN_SetThreadData(tls_key, threadCache, threadId) == FALSE)
+    ThreadData *threadData = new ThreadData(threadId);
+    threadData->GetProfile().SetMaxSites(knobMaxSites.Value());
+    if (PIN_SetThreadData(tls_key, threadData, threadId) == FALSE)
     {
         cerr << "PIN_SetThreadData failed." << endl;
         PIN_ExitProcess(1);
     }
+
+    PIN_GetLock(&allThreadDataLock, threadId);
+    allThreadData.push_back(threadData);
+    PIN_ReleaseLock(&allThreadDataLock);
+    manager.UpdateProfileBytes(0, sizeof(ThreadData), threadId);
 }
 
+// Fold the profile of an exiting thread into summary and free it, so
+// that programs that keep starting threads don't accumulate their profiles
+//
 VOID ThreadFini(THREADID threadId, const CONTEXT *ctxt, INT32 code, VOID* v)
 {
-    pair<ADDRINT, Backtrace> *threadCache = static_cast<pair<ADDRINT, Backtrace>*>(PIN_GetThreadData(tls_key, threadId));
-    delete threadCache;
+    ThreadData *threadData = static_cast<ThreadData*>(PIN_GetThreadData(tls_key, threadId));
+    UINT64 oldBytes, newBytes;
+
+    PIN_SetThreadData(tls_key, nullptr, threadId);
+    if (threadData == nullptr)
+    {
+        return;
+    }
+
+    PIN_GetLock(&allThreadDataLock, threadId);
+    allThreadData.erase(find(allThreadData.begin(), allThreadData.end(), threadData));
+    oldBytes = summary.GetSiteBytes() + threadData->GetProfile().GetSiteBytes() + sizeof(ThreadData);
+    summary.Fold(&threadData->GetProfile());
+    newBytes = summary.GetSiteBytes();
+    PIN_ReleaseLock(&allThreadDataLock);
+
+    manager.UpdateProfileBytes(oldBytes, newBytes, threadId);
+    delete threadData;
 }
 
 // Function arguments and backtrace can only be accessed at the function entry point
@@ -70,9 +192,14 @@ VOID MallocBefore(THREADID threadId, CONTEXT *ctxt, ADDRINT size)
     PIN_ReleaseLock(&updateOutputLock);
     #endif
 
-    pair<ADDRINT, Backtrace> *threadCache = static_cast<pair<ADDRINT, Backtrace>*>(PIN_GetThreadData(tls_key, threadId));
-    threadCache->second.SetTrace(ctxt);
-    threadCache->first = size;
+    if (atomic_fetch_add(&numAllocsSeen, 1) + 1 == skipAllocs)
+    {
+        UpdateRoi(threadId, FALSE);
+    }
+
+    ThreadData *threadData = static_cast<ThreadData*>(PIN_GetThreadData(tls_key, threadId));
+    threadData->SetMallocArgs(ctxt, size);
+    threadData->StartMalloc();
 }
 
 VOID MallocAfter(THREADID threadId, ADDRINT retVal)
@@ -81,10 +208,12 @@ VOID MallocAfter(THREADID threadId, ADDRINT retVal)
     //
     if ((VOID *) retVal == nullptr) { return; }
 
-    pair<ADDRINT, Backtrace> *threadCache = static_cast<pair<ADDRINT, Backtrace>*>(PIN_GetThreadData(tls_key, threadId));
-    UINT32 size = threadCache->first;
-    Backtrace b = threadCache->second;
-    manager.AddObject(retVal, size, b, threadId);
+    ThreadData *threadData = static_cast<ThreadData*>(PIN_GetThreadData(tls_key, threadId));
+    UINT64 cycles = threadData->StopMalloc();
+    if (manager.AddObject(retVal, threadData->GetMallocSize(), threadData->GetMallocTrace(), threadId, &threadData->GetProfile()))
+    {
+        threadData->GetProfile().RecordMalloc(threadData->GetMallocTrace(), threadData->GetMallocSize(), cycles);
+    }
 }
 
 VOID FreeHook(THREADID threadId, CONTEXT *ctxt, ADDRINT ptr)
@@ -93,45 +222,162 @@ VOID FreeHook(THREADID threadId, CONTEXT *ctxt, ADDRINT ptr)
     //
     static const UINT32 sizeThreshold = 1048576;
 
-    manager.RemoveObject(ptr, ctxt, threadId);
+    ThreadData *threadData = static_cast<ThreadData*>(PIN_GetThreadData(tls_key, threadId));
+    manager.RemoveObject(ptr, ctxt, threadId, &threadData->GetProfile());
 
     // Write out all data to output file every sizeThreshold in the event that the 
-    // application makes a lot of allocations
+    // application makes a lot of allocations, or right away if dead objects are
+    // holding on to memory we don't have the budget for
     //
-    manager.ClearDeadObjects(traceFile, sizeThreshold);
+    manager.ClearDeadObjects(traceFile, manager.IsOverBudget() ? 0 : sizeThreshold);
+    threadData->StartFree();
+}
+
+VOID FreeAfter(THREADID threadId)
+{
+    ThreadData *threadData = static_cast<ThreadData*>(PIN_GetThreadData(tls_key, threadId));
+    threadData->GetProfile().RecordFreeCycles(threadData->StopFree());
+}
+
+VOID PIN_FAST_ANALYSIS_CALL ReadsMem(THREADID threadId, ADDRINT addrRead, UINT32 readSize)
+{
+    manager.ReadObject<0>(addrRead, readSize, threadId);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL WritesMem(THREADID threadId, ADDRINT addrWritten, UINT32 writeSize)
+{
+    manager.WriteObject<0>(addrWritten, writeSize, threadId);
+}
+
+// Variants of ReadsMem/WritesMem for accesses whose size is known when the
+// instruction is instrumented, so that the size is a compile-time constant
+//
+template <UINT32 accessSize>
+VOID PIN_FAST_ANALYSIS_CALL ReadsMemSized(THREADID threadId, ADDRINT addrRead)
+{
+    manager.ReadObject<accessSize>(addrRead, accessSize, threadId);
 }
 
-VOID ReadsMem(THREADID threadId, ADDRINT addrRead, UINT32 readSize)
+template <UINT32 accessSize>
+VOID PIN_FAST_ANALYSIS_CALL WritesMemSized(THREADID threadId, ADDRINT addrWritten)
 {
-    manager.ReadObject(addrRead, readSize, threadId);
+    manager.WriteObject<accessSize>(addrWritten, accessSize, threadId);
 }
 
-VOID WritesMem(THREADID threadId, ADDRINT addrWritten, UINT32 writeSize)
+// Returns the specialized analysis routine for accesses of accessSize bytes,
+// or nullptr if there is none
+//
+AFUNPTR ReadsMemFor(UINT32 accessSize)
 {
-    manager.WriteObject(addrWritten, writeSize, threadId);
+    switch (accessSize)
+    {
+        case 1: return (AFUNPTR) ReadsMemSized<1>;
+        case 2: return (AFUNPTR) ReadsMemSized<2>;
+        case 4: return (AFUNPTR) ReadsMemSized<4>;
+        case 8: return (AFUNPTR) ReadsMemSized<8>;
+        case 16: return (AFUNPTR) ReadsMemSized<16>;
+        case 32: return (AFUNPTR) ReadsMemSized<32>;
+        case 64: return (AFUNPTR) ReadsMemSized<64>;
+        default: return nullptr;
+    }
+}
+
+AFUNPTR WritesMemFor(UINT32 accessSize)
+{
+    switch (accessSize)
+    {
+        case 1: return (AFUNPTR) WritesMemSized<1>;
+        case 2: return (AFUNPTR) WritesMemSized<2>;
+        case 4: return (AFUNPTR) WritesMemSized<4>;
+        case 8: return (AFUNPTR) WritesMemSized<8>;
+        case 16: return (AFUNPTR) WritesMemSized<16>;
+        case 32: return (AFUNPTR) WritesMemSized<32>;
+        case 64: return (AFUNPTR) WritesMemSized<64>;
+        default: return nullptr;
+    }
 }
 
 VOID Instruction(INS ins, VOID *v) 
 {
+    BOOL scattered;
+    AFUNPTR sized;
+
+    // Outside the region of interest only malloc and free are instrumented
+    //
+    if (!roiActive)
+    {
+        return;
+    }
+
+    // Gathers and scatters don't have a single access size, so they always
+    // go through the generic routines
+    //
+    scattered = INS_HasScatteredMemoryAccess(ins);
+
     if (INS_IsMemoryRead(ins) && !INS_IsStackRead(ins)) 
     {
-        // Intercept read instructions that don't read from the stack with ReadsMem
+        // Intercept read instructions that don't read from the stack with
+        // ReadsMem, or its variant for this instruction's access size
         //
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) ReadsMem,
-                        IARG_THREAD_ID,
-                        IARG_MEMORYREAD_EA,
-                        IARG_MEMORYREAD_SIZE,
-                        IARG_END);
+        sized = scattered ? nullptr : ReadsMemFor(INS_MemoryReadSize(ins));
+        if (sized != nullptr)
+        {
+            INS_InsertCall(ins, IPOINT_BEFORE, sized,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_THREAD_ID,
+                            IARG_MEMORYREAD_EA,
+                            IARG_END);
+        }
+        else {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) ReadsMem,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_THREAD_ID,
+                            IARG_MEMORYREAD_EA,
+                            IARG_MEMORYREAD_SIZE,
+                            IARG_END);
+        }
     }
 
     if (INS_IsMemoryWrite(ins) && !INS_IsStackWrite(ins)) 
     {
-        // Intercept write instructions that don't write to the stack with WritesMem
+        // Intercept write instructions that don't write to the stack with
+        // WritesMem, or its variant for this instruction's access size
         //
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) WritesMem,
+        sized = scattered ? nullptr : WritesMemFor(INS_MemoryWriteSize(ins));
+        if (sized != nullptr)
+        {
+            INS_InsertCall(ins, IPOINT_BEFORE, sized,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_THREAD_ID,
+                            IARG_MEMORYWRITE_EA,
+                            IARG_END);
+        }
+        else {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) WritesMem,
+                            IARG_FAST_ANALYSIS_CALL,
+                            IARG_THREAD_ID,
+                            IARG_MEMORYWRITE_EA,
+                            IARG_MEMORYWRITE_SIZE,
+                            IARG_END);
+        }
+    }
+}
+
+VOID Trace(TRACE trace, VOID *v)
+{
+    // Count instructions only until we've skipped the first skipIns of them,
+    // after which UpdateRoi() removes this instrumentation again
+    //
+    if (atomic_load(&numInsSeen) >= skipIns)
+    {
+        return;
+    }
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR) CountInstructions,
                         IARG_THREAD_ID,
-                        IARG_MEMORYWRITE_EA,
-                        IARG_MEMORYWRITE_SIZE,
+                        IARG_UINT32, BBL_NumIns(bbl),
                         IARG_END);
     }
 }
@@ -165,24 +411,156 @@ VOID Image(IMG img, VOID *v)
                         IARG_CONST_CONTEXT, 
                         IARG_FUNCARG_ENTRYPOINT_VALUE, 
                         0, IARG_END);
+        RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) FreeAfter, // Time calls to free with FreeAfter
+                        IARG_THREAD_ID,
+                        IARG_END);
+        RTN_Close(rtn);
+    }
+
+    // HEAPSHARK_START() and HEAPSHARK_STOP() are empty functions that the
+    // application may define (see heapshark.h) to mark the region of interest
+    //
+    rtn = RTN_FindByName(img, ROI_START);
+    if (RTN_Valid(rtn)) 
+    {
+        roiStartFound = TRUE;
+        RTN_Open(rtn);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) RoiStart,
+                        IARG_THREAD_ID,
+                        IARG_END);
         RTN_Close(rtn);
     }
+
+    rtn = RTN_FindByName(img, ROI_STOP);
+    if (RTN_Valid(rtn)) 
+    {
+        RTN_Open(rtn);
+        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) RoiStop,
+                        IARG_THREAD_ID,
+                        IARG_END);
+        RTN_Close(rtn);
+    }
+}
+
+// Open fileName and begin the JSON document
+//
+VOID BeginOutput(const string &fileName)
+{
+    if (!traceFile.Open(fileName))
+    {
+        cerr << "could not open " << fileName << endl;
+        PIN_ExitProcess(1);
+    }
+    traceFile.BeginObject(); // Begin JSON
+    traceFile.Key("pid");
+    traceFile.Int(pid);
+    traceFile.Key("parentPid");
+    traceFile.Int(parentPid);
+    traceFile.Key("objects");
+    traceFile.BeginArray();
+}
+
+// Take every lock before fork() so that the child doesn't inherit one that
+// is held by a thread that won't exist in the child
+//
+VOID ForkBefore(THREADID threadId, const CONTEXT *ctxt, VOID *v)
+{
+    PIN_GetLock(&allThreadDataLock, threadId);
+    PIN_GetLock(&roiLock, threadId);
+    manager.LockForFork(threadId);
+}
+
+VOID ForkAfterInParent(THREADID threadId, const CONTEXT *ctxt, VOID *v)
+{
+    manager.UnlockAfterFork();
+    PIN_ReleaseLock(&roiLock);
+    PIN_ReleaseLock(&allThreadDataLock);
+}
+
+// The child starts out with a copy of the parent's state. Throw away everything
+// that belongs to the parent and write to <name>.<pid> from now on, so that
+// tools/merge.py can combine the results of all processes
+//
+VOID ForkAfterInChild(THREADID threadId, const CONTEXT *ctxt, VOID *v)
+{
+    ThreadData *threadData = static_cast<ThreadData*>(PIN_GetThreadData(tls_key, threadId));
+
+    manager.ResetAfterFork();
+    PIN_InitLock(&allThreadDataLock);
+    PIN_InitLock(&roiLock);
+
+    // Only the thread that called fork() exists in the child
+    //
+    for (UINT32 i = 0; i < allThreadData.size(); i++)
+    {
+        if (allThreadData[i] != threadData)
+        {
+            delete allThreadData[i];
+        }
+    }
+    allThreadData.clear();
+    allThreadData.push_back(threadData);
+    threadData->GetProfile().Reset();
+    summary.Reset();
+    numThreads = 1;
+    manager.UpdateProfileBytes(0, sizeof(ThreadData), threadId);
+
+    // Whatever is still buffered in traceFile will be written out by the parent
+    //
+    traceFile.Discard();
+    parentPid = pid;
+    pid = PIN_GetPid();
+    BeginOutput(knobOutputFile.Value() + "." + decstr(pid));
 }
 
 VOID Fini(INT32 code, VOID *v)
 {
+    UINT64 finiStart = ReadCycles();
+
+    if (knobRoi.Value() && !roiStartFound)
+    {
+        cerr << "-roi was set but the application never defined HEAPSHARK_START(), "
+             << "so no memory accesses were profiled" << endl;
+    }
+
     // << operator on ObjectManager only prints out freed objects, so
     // we need to free all objects that are still live
     //
-    manager.KillLiveObjects();
+    manager.KillLiveObjects(&exitProfile);
 
-    // NOTE: This will break the JSON format if FreeHook has printed out
-    // entries to traceFile and manager is empty
-    // Can manager ever be empty? i.e. Is it possible for an application to 
-    // ever terminate without any memory leaks?
+    // traceFile takes care of separators, so this is valid JSON even if
+    // FreeHook already wrote out every object
     //
     traceFile << manager;
-    traceFile << endl << "\t]" << endl << "}"; // Terminate JSON
+    traceFile.EndArray();
+    traceFile.Key("inheritedObjects");
+    traceFile.UInt(manager.GetNumInheritedObjects());
+
+    // Merge the histograms of every thread that is still running into those
+    // of the threads that exited. Objects that were never freed are reported
+    // under thread -1
+    //
+    for (UINT32 i = 0; i < allThreadData.size(); i++)
+    {
+        summary.Add(allThreadData[i]->GetThreadId(), &allThreadData[i]->GetProfile());
+    }
+    summary.Add(-1, &exitProfile);
+    traceFile.Key("histograms");
+    traceFile << summary;
+    traceFile.Key("reuseCandidates");
+    summary.PrintReuseCandidates(traceFile);
+    traceFile.Key("stackCandidates");
+    summary.PrintStackCandidates(traceFile, knobStackTop.Value(), knobStackLimit.Value());
+
+    traceFile.Key("trackerMemory");
+    manager.PrintTrackerMemory(traceFile);
+
+    // Time spent in Fini so far, i.e. excluding the final flush of traceFile
+    //
+    traceFile.Key("finiCycles");
+    traceFile.UInt(ReadCycles() - finiStart);
+    traceFile.EndObject(); // Terminate JSON
+    traceFile.Close();
 }
 
 INT32 Usage() 
@@ -214,12 +592,29 @@ int main(int argc, char *argv[])
         PIN_ExitProcess(1);
     }
 
-    traceFile.open(knobOutputFile.Value().c_str());
-    traceFile.setf(ios::showbase);
-    traceFile << "{" << endl << "\t\"objects\" : [" << endl; // Begin JSON
+    manager.SetBudget(knobBudget.Value() * 1024 * 1024, knobSamplePeriod.Value());
+    manager.SetGranularityThresholds(knobLineThreshold.Value(), knobPageThreshold.Value());
+    exitProfile.SetMaxSites(knobMaxSites.Value());
+
+    PIN_InitLock(&allThreadDataLock);
+    PIN_InitLock(&roiLock);
+    roiMarkerOpen = !knobRoi.Value();
+    roiStartFound = FALSE;
+    skipAllocs = knobSkipAllocs.Value();
+    skipIns = knobSkipIns.Value();
+    atomic_init(&numAllocsSeen, 0);
+    atomic_init(&numInsSeen, 0);
+    roiActive = roiMarkerOpen && skipAllocs == 0 && skipIns == 0;
+
+    pid = PIN_GetPid();
+    BeginOutput(knobOutputFile.Value());
 
+    PIN_AddForkFunction(FPOINT_BEFORE, ForkBefore, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_PARENT, ForkAfterInParent, 0);
+    PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, ForkAfterInChild, 0);
     IMG_AddInstrumentFunction(Image, 0);
     INS_AddInstrumentFunction(Instruction, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
     PIN_AddThreadStartFunction(ThreadStart, 0);
     PIN_AddThreadFiniFunction(ThreadFini, 0);
     PIN_AddFiniFunction(Fini, 0);
@@ -0,0 +1,50 @@
+// forktest allocates in a parent and a forked child. The child frees some of
+// the objects it inherited, which must only be counted, and then allocates
+// and frees its own. Combine the outputs with tools/merge.py
+
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+
+const int NUM_OBJECTS = 100, OBJ_SIZE = 64, ITERS = 1000;
+
+void touch(char *buf, int size) {
+    for (int i = 0; i < size; i++) {
+        buf[i] = 'a';
+    }
+}
+
+void churn() {
+    char *buf;
+    for (int i = 0; i < ITERS; i++) {
+        buf = (char *) malloc(OBJ_SIZE);
+        touch(buf, OBJ_SIZE);
+        free(buf);
+    }
+}
+
+int main() {
+    char *objs[NUM_OBJECTS];
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        objs[i] = (char *) malloc(OBJ_SIZE);
+        touch(objs[i], OBJ_SIZE);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        return 1;
+    }
+    if (pid == 0) {
+        for (int i = 0; i < NUM_OBJECTS / 2; i++) {
+            free(objs[i]);
+        }
+        churn();
+        return 0;
+    }
+    churn();
+    for (int i = 0; i < NUM_OBJECTS; i++) {
+        free(objs[i]);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,30 @@
+// roimarkers only touches its buffers between HEAPSHARK_START() and
+// HEAPSHARK_STOP(). Run with -roi to only profile the accesses in between
+
+#include <cstdlib>
+#include "../include/heapshark.h"
+
+const int OBJ_SIZE = 1024, ITERS = 1000;
+
+void touch(char *buf, int size) {
+    for (int i = 0; i < size; i++) {
+        buf[i] = 'a';
+    }
+}
+
+int main() {
+    char *setup = (char *) malloc(OBJ_SIZE);
+    touch(setup, OBJ_SIZE);
+
+    HEAPSHARK_START();
+    for (int i = 0; i < ITERS; i++) {
+        char *buf = (char *) malloc(OBJ_SIZE);
+        touch(buf, OBJ_SIZE);
+        free(buf);
+    }
+    HEAPSHARK_STOP();
+
+    touch(setup, OBJ_SIZE);
+    free(setup);
+    return 0;
+}
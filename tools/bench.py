@@ -0,0 +1,120 @@
+import argparse
+import glob
+import json
+import os
+import subprocess
+import tempfile
+import time
+
+# Workloads from test/, as (program, tool arguments, program arguments). Only
+# multithreaded-test takes arguments: <num_threads> <num_iters> <obj_size>.
+# roimarkers is run with -roi so that its HEAPSHARK_START/STOP markers are used
+#
+def workloads(threads, sizes, iters):
+    runs = []
+    for t in threads:
+        for s in sizes:
+            runs.append(('multithreaded-test', [], [str(t), str(iters), str(s)]))
+    for p in ['sharedbuffer', 'stackalloc', 'neverfreed', 'reusecharbuffer', 'reuseintbuffer', 'forktest']:
+        runs.append((p, [], []))
+    runs.append(('roimarkers', ['-roi'], []))
+    return runs
+
+# Run cmd and return (wall seconds, peak RSS in KB)
+#
+def measure(cmd):
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    _, status, rusage = os.wait4(proc.pid, 0)
+    elapsed = time.monotonic() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        raise RuntimeError('{} exited with status {}'.format(' '.join(cmd), status))
+    return elapsed, rusage.ru_maxrss
+
+# before is called ahead of every run
+#
+def best_of(cmd, repeat, before=None):
+    results = []
+    for _ in range(repeat):
+        if before is not None:
+            before()
+        results.append(measure(cmd))
+    return min(r[0] for r in results), max(r[1] for r in results)
+
+# Output of a process tree: <output> for the root, <output>.<pid> for every
+# forked child
+#
+def output_files(output):
+    return [f for f in glob.glob(glob.escape(output) + '*')
+            if f == output or (f[len(output)] == '.' and f[len(output) + 1:].isdigit())]
+
+# Children get a new pid on every run, so their files would pile up
+#
+def remove_outputs(output):
+    for f in output_files(output):
+        os.remove(f)
+
+def run_one(args, program, tool_args, program_args, out_dir):
+    binary = os.path.join(args.bin_dir, program)
+    output = os.path.join(out_dir, '{}-{}.json'.format(program, '-'.join(program_args) or 'default'))
+
+    native_seconds, native_rss = best_of([binary] + program_args, args.repeat)
+    pin_seconds, pin_rss = best_of([args.pin, '-t', args.tool, '-o', output] + tool_args + ['--', binary] + program_args,
+                                   args.repeat, lambda: remove_outputs(output))
+    files = [output] + sorted(f for f in output_files(output) if f != output)
+
+    result = {
+        'program': program,
+        'toolArgs': tool_args,
+        'args': program_args,
+        'nativeSeconds': native_seconds,
+        'pinSeconds': pin_seconds,
+        'slowdown': pin_seconds / native_seconds if native_seconds > 0 else None,
+        'nativeMaxRssKB': native_rss,
+        'pinMaxRssKB': pin_rss,
+        'processes': len(files),
+        'outputBytes': sum(os.path.getsize(f) for f in files),
+        'validJson': True,
+        'trackerPeakBytes': None,
+        'finiCycles': None,
+    }
+    try:
+        with open(output, 'r') as f:
+            data = json.load(f)
+        result['trackerPeakBytes'] = data['trackerMemory']['peakBytes']
+        result['finiCycles'] = data['finiCycles']
+        for name in files[1:]:
+            with open(name, 'r') as f:
+                json.load(f)
+    except (ValueError, KeyError):
+        result['validJson'] = False
+    return result
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure HeapShark overhead on the test/ workloads')
+    parser.add_argument('--pin', required=True, help='path to the pin launcher')
+    parser.add_argument('--tool', required=True, help='path to heapshark.so')
+    parser.add_argument('--bin-dir', required=True, help='directory containing the compiled test/ programs')
+    parser.add_argument('--output', default='bench.json', help='where to write the results')
+    parser.add_argument('--threads', default='1,4', help='thread counts for multithreaded-test')
+    parser.add_argument('--sizes', default='64,1024', help='object sizes for multithreaded-test')
+    parser.add_argument('--iters', type=int, default=1000, help='iterations per thread for multithreaded-test')
+    parser.add_argument('--repeat', type=int, default=3, help='runs per configuration, the fastest one is kept')
+    args = parser.parse_args()
+
+    threads = [int(t) for t in args.threads.split(',')]
+    sizes = [int(s) for s in args.sizes.split(',')]
+
+    results = []
+    with tempfile.TemporaryDirectory() as out_dir:
+        for program, tool_args, program_args in workloads(threads, sizes, args.iters):
+            result = run_one(args, program, tool_args, program_args, out_dir)
+            print('{} {}: {:.1f}x slowdown, {} output bytes'.format(
+                program, ' '.join(program_args), result['slowdown'] or 0, result['outputBytes']))
+            results.append(result)
+
+    with open(args.output, 'w') as f:
+        json.dump({'tool': args.tool, 'repeat': args.repeat, 'runs': results}, f, indent=4)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,207 @@
+import argparse
+import glob
+import json
+import os
+
+# Combine the output of a process tree traced with heapshark. The root process
+# writes to <output>, every forked child to <output>.<pid>
+#
+
+def load(files):
+    processes = []
+    for name in files:
+        with open(name, 'r') as f:
+            data = json.load(f)
+        data['file'] = name
+        processes.append(data)
+    return processes
+
+# Backtraces are written as {depth: location}. Sites are told apart by all of
+# their frames, since the innermost one is often an allocation wrapper
+#
+def trace_key(trace):
+    return tuple(trace[k] for k in sorted(trace, key=int))
+
+# Objects are aggregated by their malloc site. A child doesn't write out the
+# objects it inherited from its parent, so every object is only listed once
+#
+def merge_objects(processes):
+    sites = {}
+    for p in processes:
+        for o in p['objects']:
+            s = sites.setdefault(trace_key(o['mallocBacktrace']), {
+                'mallocSite': o['mallocBacktrace'],
+                'objects': 0,
+                'bytes': 0,
+                'numReads': 0,
+                'numWrites': 0,
+                'bytesRead': 0,
+                'bytesWritten': 0,
+                'processes': set(),
+            })
+            s['objects'] += 1
+            s['bytes'] += o['size']
+            s['numReads'] += o['numReads']
+            s['numWrites'] += o['numWrites']
+            s['bytesRead'] += o['bytesRead']
+            s['bytesWritten'] += o['bytesWritten']
+            s['processes'].add(p['pid'])
+    result = sorted(sites.values(), key=lambda s: s['objects'], reverse=True)
+    for s in result:
+        s['processes'] = sorted(s['processes'])
+    return result
+
+def merge_histogram(a, b):
+    if b['count'] == 0:
+        return a
+    if a['count'] == 0:
+        return b
+    buckets = {}
+    for lower, count in a['buckets'] + b['buckets']:
+        buckets[lower] = buckets.get(lower, 0) + count
+    return {
+        'count': a['count'] + b['count'],
+        'sum': a['sum'] + b['sum'],
+        'min': min(a['min'], b['min']),
+        'max': max(a['max'], b['max']),
+        'buckets': sorted([lower, count] for lower, count in buckets.items()),
+    }
+
+def merge_histograms(processes):
+    keys = ['size', 'lifetimeCycles', 'bytesTouched']
+    merged = None
+    sites = {}
+    for p in processes:
+        h = p['histograms']
+        if merged is None:
+            merged = {k: h[k] for k in keys}
+        else:
+            for k in keys:
+                merged[k] = merge_histogram(merged[k], h[k])
+        for s in h['sites']:
+            site = trace_key(s['site'])
+            if site in sites:
+                for k in keys:
+                    sites[site][k] = merge_histogram(sites[site][k], s[k])
+            else:
+                sites[site] = dict([('site', s['site'])] + [(k, s[k]) for k in keys])
+    merged['sites'] = sorted(sites.values(), key=lambda s: s['size']['count'], reverse=True)
+    for k in ['unprofiledSiteObjects', 'unprofiledSiteMallocs']:
+        merged[k] = sum(p['histograms'].get(k, 0) for p in processes)
+    return merged
+
+# Must match reuseSizeSlack in include/allocationprofile.hpp
+#
+REUSE_SIZE_SLACK = 2
+
+# A site is only a reuse candidate if its objects never overlapped in any
+# process, so candidates are recomputed from the reuse state of every site
+# rather than combined from each process's candidate list
+#
+def merge_reuse_candidates(processes):
+    sites = {}
+    for p in processes:
+        for s in p['histograms']['sites']:
+            r = s['reuse']
+            m = sites.get(trace_key(s['site']))
+            if m is None:
+                sites[trace_key(s['site'])] = dict(r, mallocSite=s['site'])
+                continue
+            if not any(m['freeSite'].values()):
+                m['freeSite'] = r['freeSite']
+            m['allocations'] += r['allocations']
+            m['serialized'] += r['serialized']
+            m['overlapped'] = m['overlapped'] or r['overlapped']
+            m['minSize'] = min(m['minSize'], r['minSize'])
+            m['maxSize'] = max(m['maxSize'], r['maxSize'])
+            m['threads'] += r['threads']
+    candidates = []
+    for m in sites.values():
+        if m['overlapped'] or m['serialized'] == 0 or m['maxSize'] > REUSE_SIZE_SLACK * m['minSize']:
+            continue
+        candidates.append({
+            'mallocSite': m['mallocSite'],
+            'freeSite': m['freeSite'],
+            'allocations': m['allocations'],
+            'eliminatedPairs': m['serialized'],
+            'minSize': m['minSize'],
+            'maxSize': m['maxSize'],
+            'threads': m['threads'],
+        })
+    return sorted(candidates, key=lambda c: c['eliminatedPairs'], reverse=True)
+
+# Like reuse candidates, stack candidates are recomputed from the stack state
+# of every site, so that sites outside each process's top list count too and
+# the averages come out as if a single process had made every call
+#
+def merge_stack_candidates(processes, stack_limit, stack_top):
+    sites = {}
+    for p in processes:
+        for s in p['histograms']['sites']:
+            st = s['stack']
+            m = sites.get(trace_key(s['site']))
+            if m is None:
+                sites[trace_key(s['site'])] = dict(st, mallocSite=s['site'], freeSite=s['reuse']['freeSite'],
+                                                    allocations=s['reuse']['allocations'])
+                continue
+            if not any(m['freeSite'].values()):
+                m['freeSite'] = s['reuse']['freeSite']
+            m['allocations'] += s['reuse']['allocations']
+            for k in ['frameLocal', 'lowCoverage', 'mallocCycles', 'freeCycles', 'timedFrees']:
+                m[k] += st[k]
+            for k in ['maxSize', 'maxBytesTouched', 'frameDepth']:
+                m[k] = max(m[k], st[k])
+    candidates = []
+    for m in sites.values():
+        if m['frameLocal'] == 0:
+            continue
+        avg_malloc = m['mallocCycles'] // m['allocations'] if m['allocations'] > 0 else 0
+        avg_free = m['freeCycles'] // m['timedFrees'] if m['timedFrees'] > 0 else 0
+        candidates.append({
+            'mallocSite': m['mallocSite'],
+            'freeSite': m['freeSite'],
+            'allocations': m['allocations'],
+            'frameLocal': m['frameLocal'],
+            'frameDepth': m['frameDepth'],
+            'lowCoverage': m['lowCoverage'],
+            'avgMallocCycles': avg_malloc,
+            'avgFreeCycles': avg_free,
+            'projectedCyclesSaved': m['frameLocal'] * (avg_malloc + avg_free),
+            'maxSize': m['maxSize'],
+            'maxBytesTouched': m['maxBytesTouched'],
+            'fitsOnStack': m['maxSize'] <= stack_limit,
+        })
+    candidates.sort(key=lambda c: c['projectedCyclesSaved'], reverse=True)
+    return candidates[:stack_top] if stack_top > 0 else candidates
+
+def main():
+    parser = argparse.ArgumentParser(description='Merge the output of a forking program traced with HeapShark')
+    parser.add_argument('input', help='output file of the root process, as passed to -o')
+    parser.add_argument('--output', default='merged.json', help='where to write the merged results')
+    parser.add_argument('--stack_limit', type=int, default=4096, help='as passed to -stack_limit')
+    parser.add_argument('--stack_top', type=int, default=10, help='as passed to -stack_top')
+    args = parser.parse_args()
+
+    files = [args.input] + sorted(f for f in glob.glob(glob.escape(args.input) + '.*')
+                                  if os.path.basename(f)[len(os.path.basename(args.input)) + 1:].isdigit())
+    processes = load(files)
+
+    merged = {
+        'processes': [{
+            'pid': p['pid'],
+            'parentPid': p['parentPid'],
+            'file': p['file'],
+            'trackerPeakBytes': p['trackerMemory']['peakBytes'],
+            'inheritedObjects': p['inheritedObjects'],
+        } for p in processes],
+        'sites': merge_objects(processes),
+        'histograms': merge_histograms(processes),
+        'reuseCandidates': merge_reuse_candidates(processes),
+        'stackCandidates': merge_stack_candidates(processes, args.stack_limit, args.stack_top),
+    }
+    with open(args.output, 'w') as f:
+        json.dump(merged, f, indent=4)
+    print('merged {} processes into {}'.format(len(processes), args.output))
+
+if __name__ == '__main__':
+    main()